@@ -0,0 +1,559 @@
+#define _GNU_SOURCE // pthread_barrier_t
+#include "tinymalloc.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim
+#endif
+
+// microbenchmarks of an allocator backend. every benchmark goes through
+// the backend table, so runs of tinymalloc and of the system allocator
+// (glibc, or jemalloc and mimalloc put in with LD_PRELOAD) print the same
+// lines and can be compared side by side. the harness's own memory is
+// mapped directly, so it never shows up in the allocators' numbers
+
+#define MAX_THREADS 64
+#define LATENCY_OPS 1000000
+#define LATENCY_SLOTS 1024
+#define HIST_BUCKETS 65536 // one per ns, the last one for anything slower
+#define SCALING_OPS 2000000 // per thread
+#define SCALING_SLOTS 256
+#define PRODUCER_OBJECTS 1000000 // per pair
+#define RING_SIZE 1024           // a power of two
+#define LARSON_SLOTS 1000
+#define LARSON_OPS 100000 // per thread and round
+#define LARSON_ROUNDS 10
+#define FRAG_OBJECTS 200000
+
+typedef struct backend {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void (*release)(void *ptr);
+  void (*trim)(void);
+} backend_t;
+
+/* trim_tinymalloc */
+static void trim_tinymalloc() { tinymalloc_trim(); }
+
+/* trim_system */
+static void trim_system() {
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+static const backend_t backends[] = {
+    {"tinymalloc", tinymalloc, tinyfree, trim_tinymalloc},
+    {"system", malloc, free, trim_system},
+};
+
+static const backend_t *backend = &backends[0];
+
+/* now_ns */
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* next_random */
+// xorshift64, one state per thread
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/* harness_alloc */
+// memory for the harness itself, zeroed and out of every backend's heap
+static void *harness_alloc(size_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return ptr;
+}
+
+/* harness_free */
+static void harness_free(void *ptr, size_t size) { munmap(ptr, size); }
+
+/* Size distributions */
+enum { DIST_SMALL, DIST_MEDIUM, DIST_LARGE, DIST_MIXED, NUM_DISTS };
+
+static const char *dist_names[NUM_DISTS] = {"small", "medium", "large",
+                                            "mixed"};
+
+/* draw_size */
+// small is 16 to 128 bytes, medium up to 4 KiB, large up to 256 KiB, and
+// mixed takes 80% small, 15% medium and 5% large
+static size_t draw_size(int dist, uint64_t *rng) {
+  uint64_t r = next_random(rng);
+  if (dist == DIST_MIXED) {
+    unsigned int pick = (unsigned int)(r % 100);
+    dist = pick < 80 ? DIST_SMALL : pick < 95 ? DIST_MEDIUM : DIST_LARGE;
+    r = next_random(rng);
+  }
+  switch (dist) {
+  case DIST_SMALL:
+    return 16 + r % (128 - 16 + 1);
+  case DIST_MEDIUM:
+    return 129 + r % (4096 - 129 + 1);
+  default:
+    return 4097 + r % (256 * 1024 - 4097 + 1);
+  }
+}
+
+/* touch */
+// writes to an allocation so it's really backed, as a program would
+static void touch(void *ptr, size_t size) {
+  ((volatile char *)ptr)[0] = 1;
+  ((volatile char *)ptr)[size - 1] = 1;
+}
+
+/* Histograms */
+typedef struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} histogram_t;
+
+/* hist_add */
+static void hist_add(histogram_t *hist, uint64_t ns) {
+  hist->counts[ns < HIST_BUCKETS ? ns : HIST_BUCKETS - 1]++;
+  hist->total++;
+  if (ns > hist->max) {
+    hist->max = ns;
+  }
+}
+
+/* hist_percentile */
+// the smallest latency at least fraction of the samples don't exceed
+static uint64_t hist_percentile(const histogram_t *hist, double fraction) {
+  uint64_t wanted = (uint64_t)(fraction * (double)hist->total);
+  uint64_t seen = 0;
+  for (uint64_t ns = 0; ns < HIST_BUCKETS; ns++) {
+    seen += hist->counts[ns];
+    if (seen > wanted) {
+      return ns;
+    }
+  }
+  return hist->max;
+}
+
+/* hist_print */
+static void hist_print(const char *what, const char *dist,
+                       const histogram_t *hist) {
+  printf("%-10s latency %-6s %-6s p50 %5llu p90 %5llu p99 %5llu "
+         "p99.9 %5llu max %8llu ns\n",
+         backend->name, dist, what,
+         (unsigned long long)hist_percentile(hist, 0.5),
+         (unsigned long long)hist_percentile(hist, 0.9),
+         (unsigned long long)hist_percentile(hist, 0.99),
+         (unsigned long long)hist_percentile(hist, 0.999),
+         (unsigned long long)hist->max);
+}
+
+/* bench_latency */
+// a working set of LATENCY_SLOTS live objects, one of which at random is
+// freed and replaced at each step, every call timed on its own. the
+// latencies include the cost of reading the clock, printed first
+static void bench_latency() {
+  uint64_t start = now_ns();
+  for (int i = 0; i < 1000; i++) {
+    now_ns();
+  }
+  printf("%-10s latency timer overhead %llu ns\n", backend->name,
+         (unsigned long long)((now_ns() - start) / 1000));
+
+  histogram_t *allocs = harness_alloc(sizeof(histogram_t));
+  histogram_t *frees = harness_alloc(sizeof(histogram_t));
+  void **slots = harness_alloc(LATENCY_SLOTS * sizeof(void *));
+  for (int dist = 0; dist < NUM_DISTS; dist++) {
+    memset(allocs, 0, sizeof(histogram_t));
+    memset(frees, 0, sizeof(histogram_t));
+    uint64_t rng = 0x9e3779b97f4a7c15;
+    for (size_t i = 0; i < LATENCY_SLOTS; i++) {
+      size_t size = draw_size(dist, &rng);
+      slots[i] = backend->alloc(size);
+      touch(slots[i], size);
+    }
+
+    for (size_t op = 0; op < LATENCY_OPS; op++) {
+      size_t slot = next_random(&rng) % LATENCY_SLOTS;
+      size_t size = draw_size(dist, &rng);
+      uint64_t t0 = now_ns();
+      backend->release(slots[slot]);
+      uint64_t t1 = now_ns();
+      slots[slot] = backend->alloc(size);
+      uint64_t t2 = now_ns();
+      touch(slots[slot], size);
+      hist_add(frees, t1 - t0);
+      hist_add(allocs, t2 - t1);
+    }
+
+    for (size_t i = 0; i < LATENCY_SLOTS; i++) {
+      backend->release(slots[i]);
+    }
+    hist_print("malloc", dist_names[dist], allocs);
+    hist_print("free", dist_names[dist], frees);
+  }
+  harness_free(slots, LATENCY_SLOTS * sizeof(void *));
+  harness_free(frees, sizeof(histogram_t));
+  harness_free(allocs, sizeof(histogram_t));
+}
+
+/* Scaling */
+static pthread_barrier_t barrier;
+
+/* scaling_worker */
+static void *scaling_worker(void *arg) {
+  uint64_t rng = 0x2545f4914f6cdd1d + (uintptr_t)arg * 0x9e3779b97f4a7c15;
+  void **slots = harness_alloc(SCALING_SLOTS * sizeof(void *));
+  pthread_barrier_wait(&barrier);
+
+  for (size_t op = 0; op < SCALING_OPS; op++) {
+    size_t slot = next_random(&rng) % SCALING_SLOTS;
+    if (slots[slot]) {
+      backend->release(slots[slot]);
+    }
+    size_t size = 16 + next_random(&rng) % 497;
+    slots[slot] = backend->alloc(size);
+    touch(slots[slot], size);
+  }
+  for (size_t i = 0; i < SCALING_SLOTS; i++) {
+    backend->release(slots[i]);
+  }
+
+  pthread_barrier_wait(&barrier);
+  harness_free(slots, SCALING_SLOTS * sizeof(void *));
+  return NULL;
+}
+
+/* bench_scaling */
+// every thread replaces random slots of its own with objects of 16 to 512
+// bytes, for 1, 2, 4, ... threads up to the limit
+static void bench_scaling(unsigned int max_threads) {
+  for (unsigned int n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads) {
+    pthread_t threads[MAX_THREADS];
+    pthread_barrier_init(&barrier, NULL, n + 1);
+    for (unsigned int i = 0; i < n; i++) {
+      pthread_create(&threads[i], NULL, scaling_worker,
+                     (void *)(uintptr_t)i);
+    }
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&barrier);
+    uint64_t elapsed = now_ns() - start;
+    for (unsigned int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    double mops = (double)n * SCALING_OPS / ((double)elapsed / 1e3);
+    printf("%-10s scaling %2u threads %8.2f Mops/s\n", backend->name, n,
+           mops);
+    if (n == max_threads) {
+      break;
+    }
+  }
+}
+
+/* Producer-Consumer */
+// a single-producer single-consumer ring per pair of threads
+typedef struct ring {
+  _Alignas(64) _Atomic size_t head; // next slot the consumer takes
+  _Alignas(64) _Atomic size_t tail; // next slot the producer fills
+  void *slots[RING_SIZE];
+} ring_t;
+
+/* producer */
+static void *producer(void *arg) {
+  ring_t *ring = arg;
+  uint64_t rng = (uintptr_t)ring | 1;
+  pthread_barrier_wait(&barrier);
+  for (size_t i = 0; i < PRODUCER_OBJECTS; i++) {
+    size_t size = 16 + next_random(&rng) % 497;
+    void *ptr = backend->alloc(size);
+    touch(ptr, size);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) ==
+           RING_SIZE) {
+      sched_yield();
+    }
+    ring->slots[tail & (RING_SIZE - 1)] = ptr;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  }
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+/* consumer */
+static void *consumer(void *arg) {
+  ring_t *ring = arg;
+  pthread_barrier_wait(&barrier);
+  for (size_t i = 0; i < PRODUCER_OBJECTS; i++) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+      sched_yield();
+    }
+    void *ptr = ring->slots[head & (RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    backend->release(ptr);
+  }
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+/* bench_producer_consumer */
+// every object is freed by another thread than the one allocating it
+static void bench_producer_consumer(unsigned int max_threads) {
+  unsigned int pairs = max_threads / 2 ? max_threads / 2 : 1;
+  ring_t *rings = harness_alloc(pairs * sizeof(ring_t));
+  pthread_t threads[MAX_THREADS];
+  pthread_barrier_init(&barrier, NULL, pairs * 2 + 1);
+  for (unsigned int i = 0; i < pairs; i++) {
+    pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+    pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  uint64_t start = now_ns();
+  pthread_barrier_wait(&barrier);
+  uint64_t elapsed = now_ns() - start;
+  for (unsigned int i = 0; i < pairs * 2; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_barrier_destroy(&barrier);
+  harness_free(rings, pairs * sizeof(ring_t));
+
+  double mops = (double)pairs * PRODUCER_OBJECTS / ((double)elapsed / 1e3);
+  printf("%-10s producer-consumer %2u pairs %8.2f Mobjects/s\n",
+         backend->name, pairs, mops);
+}
+
+/* Larson */
+// as in the larson server benchmark, each thread replaces random objects
+// of its slots, then hands them over to the thread of the next round, so
+// most of what it frees was allocated by a thread that's gone
+typedef struct larson_thread {
+  void **slots;
+  uint64_t rng;
+} larson_thread_t;
+
+/* larson_worker */
+static void *larson_worker(void *arg) {
+  larson_thread_t *state = arg;
+  for (size_t op = 0; op < LARSON_OPS; op++) {
+    size_t slot = next_random(&state->rng) % LARSON_SLOTS;
+    backend->release(state->slots[slot]);
+    size_t size = 16 + next_random(&state->rng) % 1009;
+    state->slots[slot] = backend->alloc(size);
+    touch(state->slots[slot], size);
+  }
+  return NULL;
+}
+
+/* bench_larson */
+static void bench_larson(unsigned int max_threads) {
+  larson_thread_t states[MAX_THREADS];
+  for (unsigned int i = 0; i < max_threads; i++) {
+    states[i].slots = harness_alloc(LARSON_SLOTS * sizeof(void *));
+    states[i].rng = 0x853c49e6748fea9b + i;
+    for (size_t slot = 0; slot < LARSON_SLOTS; slot++) {
+      size_t size = 16 + next_random(&states[i].rng) % 1009;
+      states[i].slots[slot] = backend->alloc(size);
+      touch(states[i].slots[slot], size);
+    }
+  }
+
+  uint64_t start = now_ns();
+  for (int round = 0; round < LARSON_ROUNDS; round++) {
+    pthread_t threads[MAX_THREADS];
+    for (unsigned int i = 0; i < max_threads; i++) {
+      pthread_create(&threads[i], NULL, larson_worker, &states[i]);
+    }
+    for (unsigned int i = 0; i < max_threads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  for (unsigned int i = 0; i < max_threads; i++) {
+    for (size_t slot = 0; slot < LARSON_SLOTS; slot++) {
+      backend->release(states[i].slots[slot]);
+    }
+    harness_free(states[i].slots, LARSON_SLOTS * sizeof(void *));
+  }
+  double mops = (double)max_threads * LARSON_OPS * LARSON_ROUNDS /
+                ((double)elapsed / 1e3);
+  printf("%-10s larson %2u threads %8.2f Mops/s\n", backend->name,
+         max_threads, mops);
+}
+
+/* Fragmentation */
+
+/* rss_bytes */
+// resident set size, from /proc/self/statm
+static size_t rss_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  unsigned long size, resident = 0;
+  if (statm) {
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* frag_report */
+static void frag_report(const char *phase, size_t live, uint64_t start) {
+  size_t rss = rss_bytes();
+  printf("%-10s fragmentation %6.2fs %-22s live %8.1f MiB rss %8.1f MiB "
+         "ratio %5.2f\n",
+         backend->name, (double)(now_ns() - start) / 1e9, phase,
+         (double)live / (1 << 20), (double)rss / (1 << 20),
+         live ? (double)rss / (double)live : 0.0);
+}
+
+/* bench_fragmentation */
+// the RSS over a run of phases that leave holes behind: mostly small
+// objects, every other one freed, 256 to 1024 byte ones that don't fit the
+// holes, then almost everything freed and the allocator asked to trim
+static void bench_fragmentation() {
+  uint64_t start = now_ns();
+  void **objects = harness_alloc(2 * FRAG_OBJECTS * sizeof(void *));
+  size_t *sizes = harness_alloc(2 * FRAG_OBJECTS * sizeof(size_t));
+  uint64_t rng = 0xdeadbeefcafef00d;
+  size_t live = 0;
+  frag_report("start", live, start);
+
+  for (size_t i = 0; i < FRAG_OBJECTS; i++) {
+    sizes[i] = draw_size(next_random(&rng) % 10 ? DIST_SMALL : DIST_MEDIUM,
+                         &rng);
+    objects[i] = backend->alloc(sizes[i]);
+    memset(objects[i], 1, sizes[i]);
+    live += sizes[i];
+  }
+  frag_report("allocated", live, start);
+
+  for (size_t i = 0; i < FRAG_OBJECTS; i += 2) {
+    backend->release(objects[i]);
+    live -= sizes[i];
+    objects[i] = NULL;
+  }
+  frag_report("every other freed", live, start);
+
+  for (size_t i = FRAG_OBJECTS; i < FRAG_OBJECTS + FRAG_OBJECTS / 2; i++) {
+    sizes[i] = 256 + next_random(&rng) % 769;
+    objects[i] = backend->alloc(sizes[i]);
+    memset(objects[i], 1, sizes[i]);
+    live += sizes[i];
+  }
+  frag_report("bigger ones allocated", live, start);
+
+  for (size_t i = 0; i < 2 * FRAG_OBJECTS; i++) {
+    if (objects[i] && i % 100 != 0) {
+      backend->release(objects[i]);
+      live -= sizes[i];
+      objects[i] = NULL;
+    }
+  }
+  frag_report("99% freed", live, start);
+  backend->trim();
+  frag_report("trimmed", live, start);
+
+  for (size_t i = 0; i < 2 * FRAG_OBJECTS; i++) {
+    if (objects[i]) {
+      backend->release(objects[i]);
+    }
+  }
+  harness_free(sizes, 2 * FRAG_OBJECTS * sizeof(size_t));
+  harness_free(objects, 2 * FRAG_OBJECTS * sizeof(void *));
+}
+
+/* usage */
+static void usage() {
+  fprintf(stderr,
+          "usage: bench_tinymalloc [-b tinymalloc|system] [-t threads] "
+          "[latency|scaling|producer|larson|fragmentation ...]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int max_threads =
+      ncpus < 1 ? 1 : ncpus > MAX_THREADS ? MAX_THREADS : (unsigned int)ncpus;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+    switch (opt) {
+    case 'b':
+      backend = NULL;
+      for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+        if (strcmp(optarg, backends[i].name) == 0) {
+          backend = &backends[i];
+        }
+      }
+      if (backend == NULL) {
+        usage();
+      }
+      break;
+    case 't':
+      max_threads = (unsigned int)atoi(optarg);
+      if (max_threads < 1 || max_threads > MAX_THREADS) {
+        usage();
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+
+  bool all = optind == argc;
+  for (int i = optind; i < argc; i++) {
+    if (strcmp(argv[i], "latency") != 0 && strcmp(argv[i], "scaling") != 0 &&
+        strcmp(argv[i], "producer") != 0 && strcmp(argv[i], "larson") != 0 &&
+        strcmp(argv[i], "fragmentation") != 0) {
+      usage();
+    }
+  }
+
+  // the fragmentation run goes first, on a heap no other benchmark touched
+  const char *order[] = {"fragmentation", "latency", "scaling", "producer",
+                         "larson"};
+  for (size_t b = 0; b < sizeof(order) / sizeof(*order); b++) {
+    bool selected = all;
+    for (int i = optind; i < argc; i++) {
+      selected = selected || strcmp(argv[i], order[b]) == 0;
+    }
+    if (!selected) {
+      continue;
+    }
+
+    if (strcmp(order[b], "fragmentation") == 0) {
+      bench_fragmentation();
+    } else if (strcmp(order[b], "latency") == 0) {
+      bench_latency();
+    } else if (strcmp(order[b], "scaling") == 0) {
+      bench_scaling(max_threads);
+    } else if (strcmp(order[b], "producer") == 0) {
+      bench_producer_consumer(max_threads);
+    } else {
+      bench_larson(max_threads);
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,395 @@
+#include "tinymalloc.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// replays the allocation calls of a trace, captured through the shim with
+// TINYMALLOC_CAPTURE or dumped by a TINYMALLOC_TRACE build, against
+// tinymalloc or the system allocator, and reports the time they took, the
+// peak RSS and how far it was from the bytes live. the records of every
+// thread are merged by timestamp and replayed on one thread, so that runs
+// are deterministic and can be compared. the trace and the pointer table
+// are mapped directly and faulted in before the replay starts, so they
+// don't count as the allocator's memory
+
+#define RSS_INTERVAL 1024 // calls replayed between RSS readings
+
+typedef struct backend {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void *(*zalloc)(size_t count, size_t size);
+  void *(*resize)(void *ptr, size_t size);
+  void *(*align)(size_t alignment, size_t size);
+  void (*release)(void *ptr);
+} backend_t;
+
+static const backend_t backends[] = {
+    {"tinymalloc", tinymalloc, tinycalloc, tinyrealloc, tiny_aligned_alloc,
+     tinyfree},
+    {"system", malloc, calloc, realloc, aligned_alloc, free},
+};
+
+static const backend_t *backend = &backends[0];
+static size_t page_size;
+
+/* Pointer table */
+// an open addressing table from the pointers of the trace to those of the
+// replay, with their sizes. removals leave tombstones
+typedef struct object {
+  uint64_t traced; // 0 for empty, 1 for removed
+  void *ptr;
+  size_t size;
+} object_t;
+
+static object_t *objects;
+static size_t objects_mask;
+
+// the object each thread's REALLOC_START took out of the table, waiting for
+// the REALLOC that ends it. ptr is NULL if the old pointer was unknown
+typedef struct pending {
+  bool open;
+  void *ptr;
+} pending_t;
+
+static pending_t *pending; // one per thread of the trace
+
+/* object_hash */
+static size_t object_hash(uint64_t traced) {
+  traced ^= traced >> 33;
+  traced *= 0xff51afd7ed558ccd;
+  traced ^= traced >> 33;
+  return (size_t)traced & objects_mask;
+}
+
+/* object_find */
+static object_t *object_find(uint64_t traced) {
+  for (size_t i = object_hash(traced);; i = (i + 1) & objects_mask) {
+    if (objects[i].traced == traced) {
+      return &objects[i];
+    }
+    if (objects[i].traced == 0) {
+      return NULL;
+    }
+  }
+}
+
+/* object_insert */
+// the table is sized for every allocation of the trace, so it never fills up
+static object_t *object_insert(uint64_t traced) {
+  for (size_t i = object_hash(traced);; i = (i + 1) & objects_mask) {
+    if (objects[i].traced <= 1) {
+      objects[i].traced = traced;
+      return &objects[i];
+    }
+  }
+}
+
+/* Trace */
+
+/* record_cmp */
+// by timestamp, then by thread
+static int record_cmp(const void *a, const void *b) {
+  const tinymalloc_trace_record_t *x = a, *y = b;
+  if (x->timestamp != y->timestamp) {
+    return x->timestamp < y->timestamp ? -1 : 1;
+  }
+  return x->thread < y->thread ? -1 : x->thread > y->thread;
+}
+
+/* is_call */
+// traces of TINYMALLOC_TRACE builds have the allocator's internal events too
+static bool is_call(uint16_t event) {
+  return event == TINYMALLOC_TRACE_MALLOC || event == TINYMALLOC_TRACE_CALLOC ||
+         event == TINYMALLOC_TRACE_REALLOC ||
+         event == TINYMALLOC_TRACE_REALLOC_START ||
+         event == TINYMALLOC_TRACE_FREE;
+}
+
+/* load_trace */
+// reads the calls of the trace into private memory and sorts them
+static tinymalloc_trace_record_t *load_trace(const char *path, size_t *count) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    exit(1);
+  }
+  size_t length = (size_t)st.st_size;
+  if (length % sizeof(tinymalloc_trace_record_t) != 0) {
+    fprintf(stderr, "%s: not a trace, or cut short\n", path);
+    exit(1);
+  }
+  if (length == 0) {
+    *count = 0;
+    close(fd);
+    return NULL;
+  }
+
+  tinymalloc_trace_record_t *records =
+      mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (records == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < length / sizeof(tinymalloc_trace_record_t); i++) {
+    if (is_call(records[i].event)) {
+      records[n++] = records[i];
+    }
+  }
+  qsort(records, n, sizeof(tinymalloc_trace_record_t), record_cmp);
+  *count = n;
+  return records;
+}
+
+/* Replay */
+typedef struct report {
+  size_t calls;
+  size_t skipped; // frees and reallocs of pointers the trace never returned
+  size_t failed;
+  size_t live;
+  size_t peak_live;
+  size_t peak_rss;
+  size_t rss_at_peak_live;
+  uint64_t elapsed;
+} report_t;
+
+/* now_ns */
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+/* rss_bytes */
+static size_t rss_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  unsigned long size, resident = 0;
+  if (statm) {
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * page_size;
+}
+
+/* touch */
+// writes a byte per page, as the traced program would have written them
+static void touch(void *ptr, size_t size) {
+  for (size_t offset = 0; offset < size; offset += page_size) {
+    ((volatile char *)ptr)[offset] = 1;
+  }
+}
+
+/* forget */
+static void forget(report_t *report, object_t *object) {
+  report->live -= object->size;
+  object->traced = 1;
+}
+
+/* replay_one */
+static void replay_one(report_t *report, const tinymalloc_trace_record_t *r) {
+  object_t *object = r->ptr ? object_find(r->ptr) : NULL;
+  void *ptr = NULL;
+
+  switch (r->event) {
+  case TINYMALLOC_TRACE_FREE:
+    if (object == NULL) {
+      report->skipped++;
+      return;
+    }
+    backend->release(object->ptr);
+    forget(report, object);
+    return;
+
+  case TINYMALLOC_TRACE_REALLOC_START:
+    pending[r->thread].open = true;
+    pending[r->thread].ptr = object ? object->ptr : NULL;
+    if (object == NULL) {
+      report->skipped++;
+      return;
+    }
+    forget(report, object);
+    return;
+
+  case TINYMALLOC_TRACE_REALLOC: {
+    // reallocs of TINYMALLOC_TRACE builds have no start, the old pointer
+    // is found by its address
+    void *old;
+    if (pending[r->thread].open) {
+      pending[r->thread].open = false;
+      if ((old = pending[r->thread].ptr) == NULL) {
+        return;
+      }
+    } else {
+      object_t *found = object_find(r->aux);
+      if (found == NULL) {
+        report->skipped++;
+        return;
+      }
+      old = found->ptr;
+      forget(report, found);
+    }
+    ptr = backend->resize(old, r->size ? r->size : 1);
+    if (ptr == NULL) {
+      report->failed++;
+      backend->release(old);
+      return;
+    }
+    object = r->ptr ? object_find(r->ptr) : NULL;
+    break;
+  }
+
+  case TINYMALLOC_TRACE_CALLOC:
+    ptr = backend->zalloc(1, r->size ? r->size : 1);
+    break;
+
+  default:
+    ptr = r->aux ? backend->align(r->aux, r->size ? r->size : 1)
+                 : backend->alloc(r->size ? r->size : 1);
+  }
+
+  if (ptr == NULL) {
+    report->failed++;
+    return;
+  }
+  // an address handed out again before its free was recorded, by threads
+  // racing around a realloc in traces of TINYMALLOC_TRACE builds. the
+  // earlier object is dropped
+  if (object) {
+    backend->release(object->ptr);
+    forget(report, object);
+  }
+  object = object_insert(r->ptr);
+  object->ptr = ptr;
+  object->size = r->size;
+  report->live += r->size;
+  touch(ptr, r->size);
+}
+
+/* replay */
+// only the calls are timed, not the RSS readings between them
+static void replay(report_t *report, const tinymalloc_trace_record_t *records,
+                   size_t count) {
+  size_t baseline = rss_bytes();
+  for (size_t first = 0; first < count; first += RSS_INTERVAL) {
+    size_t last = first + RSS_INTERVAL < count ? first + RSS_INTERVAL : count;
+    bool new_peak = false;
+
+    uint64_t start = now_ns();
+    for (size_t i = first; i < last; i++) {
+      replay_one(report, &records[i]);
+      if (report->live > report->peak_live) {
+        report->peak_live = report->live;
+        new_peak = true;
+      }
+    }
+    report->elapsed += now_ns() - start;
+
+    size_t rss = rss_bytes();
+    rss = rss > baseline ? rss - baseline : 0;
+    if (rss > report->peak_rss) {
+      report->peak_rss = rss;
+    }
+    if (new_peak) {
+      report->rss_at_peak_live = rss;
+    }
+  }
+  report->calls = count;
+}
+
+/* usage */
+static void usage() {
+  fprintf(stderr, "usage: replay_tinymalloc [-b tinymalloc|system] trace\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "b:")) != -1) {
+    if (opt != 'b') {
+      usage();
+    }
+    backend = NULL;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++) {
+      if (strcmp(optarg, backends[i].name) == 0) {
+        backend = &backends[i];
+      }
+    }
+    if (backend == NULL) {
+      usage();
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+  }
+
+  page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t count;
+  tinymalloc_trace_record_t *records = load_trace(argv[optind], &count);
+  uint32_t threads = 0;
+  size_t allocations = 0;
+  for (size_t i = 0; i < count; i++) {
+    threads = records[i].thread >= threads ? records[i].thread + 1 : threads;
+    allocations += records[i].event != TINYMALLOC_TRACE_FREE &&
+                   records[i].event != TINYMALLOC_TRACE_REALLOC_START;
+  }
+
+  // a power of two at least twice the allocations, tombstones included
+  size_t slots = 1024;
+  while (slots < 2 * allocations) {
+    slots *= 2;
+  }
+  objects = mmap(NULL, slots * sizeof(object_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (objects == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memset(objects, 0, slots * sizeof(object_t));
+  objects_mask = slots - 1;
+
+  pending = mmap(NULL, (threads + 1) * sizeof(pending_t),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pending == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+
+  report_t report = {0};
+  replay(&report, records, count);
+
+  const double mib = 1 << 20;
+  printf("%s: %zu calls of %u threads in %.3f s, %.1f ns per call\n",
+         backend->name, report.calls, threads, (double)report.elapsed / 1e9,
+         report.calls ? (double)report.elapsed / (double)report.calls : 0.0);
+  printf("skipped %zu calls on pointers never allocated, %zu failed\n",
+         report.skipped, report.failed);
+  printf("peak rss %.1f MiB, peak live %.1f MiB with %.1f MiB resident "
+         "(%.2fx)\n",
+         (double)report.peak_rss / mib, (double)report.peak_live / mib,
+         (double)report.rss_at_peak_live / mib,
+         report.peak_live
+             ? (double)report.rss_at_peak_live / (double)report.peak_live
+             : 0.0);
+
+  if (backend == &backends[0]) {
+    tinymalloc_stats_t stats;
+    tinymalloc_stats(&stats);
+    printf("at the end, %.1f MiB mapped: %.1f MiB allocated, %.1f MiB free, "
+           "%.1f MiB fragmented\n",
+           (double)stats.mapped / mib, (double)stats.allocated / mib,
+           (double)stats.free / mib, (double)stats.fragmented / mib);
+  }
+  return 0;
+}
@@ -1,9 +1,32 @@
 #include "tinymalloc.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// debug builds wrap and quarantine every allocation, so the tests of where
+// memory comes from and when it goes back don't apply to them
+#ifdef TINYMALLOC_DEBUG
+#define SKIP_IN_DEBUG_BUILDS()                                                 \
+  do {                                                                         \
+    printf("skipped in debug builds\n\n");                                     \
+    return;                                                                    \
+  } while (0)
+#else
+#define SKIP_IN_DEBUG_BUILDS()
+#endif
 
 #define NUM_THREADS 4
 #define ALLOCS_PER_THREAD 1000
@@ -59,6 +82,737 @@ void test_alloc_large_size() {
   printf("PASSED :-)\n\n");
 }
 
+// tells whether the page holding ptr is still mapped
+static int is_mapped(void *ptr) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *base = (void *)((uintptr_t)ptr & ~(uintptr_t)(page - 1));
+  return msync(base, page, MS_ASYNC) == 0;
+}
+
+void test_large_alloc_unmapped() {
+  printf("testing large allocations are unmapped on free...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  char *ptr = tinymalloc(256 * 1024);
+  assert(ptr != NULL);
+  memset(ptr, 0xab, 256 * 1024);
+  assert(is_mapped(ptr));
+  tinyfree(ptr);
+  assert(!is_mapped(ptr));
+
+  // below the threshold the block stays in its arena
+  char *small = tinymalloc(4096);
+  assert(small != NULL);
+  tinyfree(small);
+  assert(is_mapped(small));
+  printf("PASSED :-)\n\n");
+}
+
+void test_large_threshold() {
+  printf("testing large allocation threshold...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  assert(tinymalloc_set_large_threshold(100) == -1 && errno == EINVAL);
+
+  assert(tinymalloc_set_large_threshold(8192) == 0);
+  char *ptr = tinymalloc(16 * 1024);
+  assert(ptr != NULL);
+  memset(ptr, 0xcd, 16 * 1024);
+  tinyfree(ptr);
+  assert(!is_mapped(ptr));
+
+  assert(tinymalloc_set_large_threshold(128 * 1024) == 0);
+  printf("PASSED :-)\n\n");
+}
+
+#define GROWTH_BLOCKS 256
+#define GROWTH_BLOCK_SIZE (64 * 1024)
+
+void test_heap_growth() {
+  printf("testing heap growth by segments...\n");
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // 16mb in blocks below the large threshold, all from the arena heaps
+  static char *blocks[GROWTH_BLOCKS];
+  for (int i = 0; i < GROWTH_BLOCKS; i++) {
+    blocks[i] = tinymalloc(GROWTH_BLOCK_SIZE);
+    assert(blocks[i] != NULL);
+    memset(blocks[i], i, GROWTH_BLOCK_SIZE);
+  }
+  for (int i = 0; i < GROWTH_BLOCKS; i++) {
+    assert(blocks[i][0] == (char)i);
+    assert(blocks[i][GROWTH_BLOCK_SIZE - 1] == (char)i);
+    tinyfree(blocks[i]);
+  }
+
+#ifdef TINYMALLOC_TRACE
+  // segments double in size, so this takes a handful of mappings
+  FILE *file = tmpfile();
+  assert(file != NULL);
+  tinymalloc_trace_dump(fileno(file));
+  rewind(file);
+  uint64_t since = (uint64_t)start.tv_sec * 1000000000 + start.tv_nsec;
+  tinymalloc_trace_record_t record;
+  int maps = 0;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    if (record.event == TINYMALLOC_TRACE_MAP && record.timestamp >= since) {
+      maps++;
+    }
+  }
+  fclose(file);
+  assert(maps > 0 && maps < 16);
+#endif
+  printf("PASSED :-)\n\n");
+}
+
+#define HUGE_SEGMENT_BLOCK (96 * 1024 * 1024)
+
+void test_huge_pages() {
+  printf("testing huge page segments...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  assert(tinymalloc_set_huge_pages(42) == -1 && errno == EINVAL);
+  assert(tinymalloc_set_large_threshold((size_t)1 << 30) == 0);
+
+  // a block past the biggest segment size gets a segment of its own, whose
+  // first block starts right after the segment header. without explicit
+  // huge pages reserved, HUGETLB falls back to transparent ones
+  int modes[] = {TINYMALLOC_HUGE_THP, TINYMALLOC_HUGE_HUGETLB};
+  for (int i = 0; i < 2; i++) {
+    assert(tinymalloc_set_huge_pages(modes[i]) == 0);
+    char *ptr = tinymalloc(HUGE_SEGMENT_BLOCK);
+    assert(ptr != NULL);
+    assert(((uintptr_t)ptr & (2 * 1024 * 1024 - 1)) < 64);
+    ptr[0] = 1;
+    ptr[HUGE_SEGMENT_BLOCK - 1] = 2;
+    tinyfree(ptr);
+    tinymalloc_trim(); // unmaps the segment, the next one is new
+  }
+
+  assert(tinymalloc_set_huge_pages(TINYMALLOC_HUGE_NONE) == 0);
+  assert(tinymalloc_set_large_threshold(128 * 1024) == 0);
+  printf("PASSED :-)\n\n");
+}
+
+void test_block_header_overhead() {
+  printf("testing block header overhead...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  // 2040 bytes plus an 8-byte header make exactly 2048, so consecutive
+  // blocks carved from the same free run are 2048 bytes apart
+  char *a = tinymalloc(2040);
+  char *b = tinymalloc(2040);
+  assert(a != NULL && b != NULL);
+  assert(b - a == 2048);
+  memset(a, 0x11, 2040);
+  memset(b, 0x22, 2040);
+  assert(a[2039] == 0x11 && b[0] == 0x22);
+  tinyfree(a);
+  tinyfree(b);
+  printf("PASSED :-)\n\n");
+}
+
+void test_coalesce_neighbours() {
+  printf("testing coalescing of physical neighbours...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  char *a = tinymalloc(3000);
+  char *b = tinymalloc(3000);
+  char *c = tinymalloc(3000);
+  char *guard = tinymalloc(3000); // keeps c from merging with the rest
+  assert(a && b && c && guard);
+
+  // freeing the middle block last merges it with both neighbours at once,
+  // and the merged block is the one reused for a request filling it
+  tinyfree(a);
+  tinyfree(c);
+  tinyfree(b);
+  char *merged = tinymalloc(c + 3000 - a);
+  assert(merged == a);
+  tinyfree(merged);
+  tinyfree(guard);
+  printf("PASSED :-)\n\n");
+}
+
+void test_deferred_coalescing() {
+  printf("testing deferred coalescing...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  tinymalloc_set_deferred_coalescing(64);
+  char *a = tinymalloc(3000);
+  char *b = tinymalloc(3000);
+  char *c = tinymalloc(3000);
+  char *guard = tinymalloc(3000);
+  assert(a && b && c && guard);
+
+  // a freed block goes back as it is to the next request of its size
+  tinyfree(b);
+  assert(tinymalloc(3000) == b);
+
+  // neighbours freed together stay apart until a consolidation pass, such
+  // as the one trimming starts with, merges them
+  tinyfree(a);
+  tinyfree(c);
+  tinyfree(b);
+  char *other = tinymalloc(c + 3000 - a);
+  assert(other != NULL && other != a);
+  tinyfree(other);
+  tinymalloc_trim();
+  char *merged = tinymalloc(c + 3000 - a);
+  assert(merged == a);
+  tinyfree(merged);
+  tinyfree(guard);
+
+  unsigned int blocks = 0;
+  size_t len = sizeof(blocks);
+  assert(tinymalloc_ctl("opt.deferred_coalescing", &blocks, &len, NULL, 0) ==
+             0 &&
+         blocks == 64);
+  tinymalloc_set_deferred_coalescing(0);
+  tinymalloc_trim();
+  printf("PASSED :-)\n\n");
+}
+
+// tells whether the page holding ptr is backed by memory
+static int is_resident(void *ptr) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  void *base = (void *)((uintptr_t)ptr & ~(uintptr_t)(page - 1));
+  unsigned char vec = 0;
+  return mincore(base, page, &vec) == 0 && (vec & 1);
+}
+
+#define TRIM_BLOCK (100 * 1024)
+
+void test_trim() {
+  printf("testing tinymalloc_trim gives free runs back...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  char *blocks[6];
+  for (int i = 0; i < 6; i++) {
+    blocks[i] = tinymalloc(TRIM_BLOCK);
+    assert(blocks[i] != NULL);
+    memset(blocks[i], 'a' + i, TRIM_BLOCK);
+  }
+
+  char *middle = blocks[2] + TRIM_BLOCK / 2;
+  assert(is_resident(middle));
+  for (int i = 1; i < 5; i++) {
+    tinyfree(blocks[i]);
+  }
+  assert(tinymalloc_trim() > 0);
+  assert(!is_resident(middle));
+
+  // the blocks around the run keep their contents
+  for (size_t i = 0; i < TRIM_BLOCK; i++) {
+    assert(blocks[0][i] == 'a' && blocks[5][i] == 'f');
+  }
+
+  // and the run can be used again
+  char *ptr = tinymalloc(3 * TRIM_BLOCK);
+  assert(ptr != NULL);
+  memset(ptr, 0x77, 3 * TRIM_BLOCK);
+  tinyfree(ptr);
+  tinyfree(blocks[0]);
+  tinyfree(blocks[5]);
+
+  // empty slabs are given back once, a trim right after has nothing left
+  static void *small[4096];
+  for (int i = 0; i < 4096; i++) {
+    small[i] = tinymalloc(256);
+    assert(small[i] != NULL);
+    memset(small[i], i, 256);
+  }
+  for (int i = 0; i < 4096; i++) {
+    tinyfree(small[i]);
+  }
+  assert(tinymalloc_trim() > 0);
+  assert(tinymalloc_trim() == 0);
+  printf("PASSED :-)\n\n");
+}
+
+void test_decay() {
+  printf("testing free runs decay...\n");
+  // with no delay, runs are purged as soon as they're freed
+  tinymalloc_set_decay(0);
+  for (int round = 0; round < 8; round++) {
+    char *blocks[3];
+    for (int i = 0; i < 3; i++) {
+      blocks[i] = tinymalloc(TRIM_BLOCK);
+      assert(blocks[i] != NULL);
+      memset(blocks[i], round + i, TRIM_BLOCK);
+    }
+    tinyfree(blocks[1]);
+    for (size_t i = 0; i < TRIM_BLOCK; i++) {
+      assert(blocks[0][i] == (char)round && blocks[2][i] == (char)(round + 2));
+    }
+    tinyfree(blocks[0]);
+    tinyfree(blocks[2]);
+  }
+  tinymalloc_set_decay(1000);
+  printf("PASSED :-)\n\n");
+}
+
+void test_realloc_in_place() {
+  printf("testing in-place realloc...\n");
+  char *ptr = tinymalloc(4000);
+  char *guard = tinymalloc(4000); // fixes what follows ptr
+  assert(ptr != NULL && guard != NULL);
+  memset(ptr, 0x5a, 4000);
+
+  // shrinking frees the tail, growing back absorbs it again
+  assert(tinyrealloc(ptr, 2000) == ptr);
+  assert(tinyrealloc(ptr, 4000) == ptr);
+  for (int i = 0; i < 2000; i++) {
+    assert(ptr[i] == 0x5a);
+  }
+
+  // once the successor is taken, a grow has to move
+  char *moved = tinyrealloc(ptr, 16000);
+  assert(moved != NULL && moved != ptr);
+  for (int i = 0; i < 2000; i++) {
+    assert(moved[i] == 0x5a);
+  }
+  tinyfree(moved);
+  tinyfree(guard);
+  printf("PASSED :-)\n\n");
+}
+
+void test_realloc_across_paths() {
+  printf("testing realloc across slabs, blocks and large mappings...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  assert(tinyrealloc(NULL, 0) == NULL);
+  char *ptr = tinyrealloc(NULL, 20);
+  assert(ptr != NULL);
+  strcpy(ptr, "tinymalloc realloc");
+
+  // the 32-byte slab class still fits 30 bytes
+  assert(tinyrealloc(ptr, 30) == ptr);
+
+  ptr = tinyrealloc(ptr, 3000);
+  assert(ptr != NULL && strcmp(ptr, "tinymalloc realloc") == 0);
+  ptr = tinyrealloc(ptr, 1024 * 1024);
+  assert(ptr != NULL && strcmp(ptr, "tinymalloc realloc") == 0);
+  ptr[1024 * 1024 - 1] = 1;
+  ptr = tinyrealloc(ptr, 8 * 1024 * 1024);
+  assert(ptr != NULL && strcmp(ptr, "tinymalloc realloc") == 0);
+  assert(ptr[1024 * 1024 - 1] == 1);
+  ptr[8 * 1024 * 1024 - 1] = 2;
+  ptr = tinyrealloc(ptr, 10);
+  assert(ptr != NULL && memcmp(ptr, "tinymalloc", 10) == 0);
+  assert(tinyrealloc(ptr, 0) == NULL);
+  printf("PASSED :-)\n\n");
+}
+
+static int is_zero(const char *ptr, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    if (ptr[i] != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void test_calloc() {
+  printf("testing calloc...\n");
+  assert(tinycalloc(0, 16) == NULL);
+  assert(tinycalloc(16, 0) == NULL);
+  assert(tinycalloc(SIZE_MAX / 2, 3) == NULL);
+
+  // dirty memory handed out again must be cleared, whichever path serves
+  // it: slab objects, blocks and large mappings
+  size_t sizes[] = {64, 3000, 40000, 1024 * 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char *dirty = tinymalloc(sizes[i]);
+    assert(dirty != NULL);
+    memset(dirty, 0xff, sizes[i]);
+    tinyfree(dirty);
+
+    char *ptr = tinycalloc(1, sizes[i]);
+    assert(ptr != NULL);
+    assert(is_zero(ptr, sizes[i]));
+    memset(ptr, 0xff, sizes[i]);
+    tinyfree(ptr);
+  }
+
+  // fresh heap memory is known zero, only block metadata gets cleared
+  char *blocks[8];
+  for (int i = 0; i < 8; i++) {
+    blocks[i] = tinycalloc(250, 100);
+    assert(blocks[i] != NULL && is_zero(blocks[i], 25000));
+    memset(blocks[i], 0xee, 25000);
+  }
+  for (int i = 0; i < 8; i++) {
+    tinyfree(blocks[i]);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+void test_aligned_alloc() {
+  printf("testing aligned allocation...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  size_t alignments[] = {32, 64, 128, 4096, 2 * 1024 * 1024};
+  size_t sizes[] = {1, 48, 100, 1000, 5000, 300 * 1024};
+  for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++) {
+    for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+      char *ptr = tiny_aligned_alloc(alignments[i], sizes[j]);
+      assert(ptr != NULL);
+      assert(((uintptr_t)ptr & (alignments[i] - 1)) == 0);
+      memset(ptr, 0x77, sizes[j]);
+      tinyfree(ptr);
+    }
+  }
+
+  // cache-line aligned small objects come from slabs, packed back to back
+  char *a = tiny_aligned_alloc(64, 64);
+  char *b = tiny_aligned_alloc(64, 64);
+  assert(a != NULL && b != NULL);
+  assert(b - a == 64 || a - b == 64);
+  tinyfree(a);
+  tinyfree(b);
+
+  errno = 0;
+  assert(tiny_aligned_alloc(48, 100) == NULL && errno == EINVAL);
+  assert(tiny_aligned_alloc(64, 0) == NULL);
+  printf("PASSED :-)\n\n");
+}
+
+void test_posix_memalign() {
+  printf("testing posix_memalign...\n");
+  void *ptr = NULL;
+  assert(tiny_posix_memalign(&ptr, 4096, 10000) == 0);
+  assert(ptr != NULL && ((uintptr_t)ptr & 4095) == 0);
+  memset(ptr, 0x33, 10000);
+  tinyfree(ptr);
+
+  assert(tiny_posix_memalign(&ptr, 4, 100) == EINVAL);
+  assert(tiny_posix_memalign(&ptr, 96, 100) == EINVAL);
+  assert(tiny_posix_memalign(&ptr, 64, SIZE_MAX) == ENOMEM);
+  printf("PASSED :-)\n\n");
+}
+
+void test_free_sized() {
+  printf("testing sized free...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  // freed objects go back to the cache of their class, and are reused
+  size_t sizes[] = {1, 16, 100, 500, 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    void *ptr = tinymalloc(sizes[i]);
+    assert(ptr != NULL);
+    tinyfree_sized(ptr, sizes[i]);
+    assert(tinymalloc(sizes[i]) == ptr);
+    tinyfree_sized(ptr, sizes[i]);
+  }
+
+  // blocks and large mappings are freed as usual
+  void *block = tinymalloc(3000);
+  assert(block != NULL);
+  tinyfree_sized(block, 3000);
+  char *large = tinymalloc(1024 * 1024);
+  assert(large != NULL);
+  tinyfree_sized(large, 1024 * 1024);
+  assert(!is_mapped(large));
+  tinyfree_sized(NULL, 100);
+  printf("PASSED :-)\n\n");
+}
+
+#define BATCH_SIZE 256
+
+void test_batch() {
+  printf("testing batch allocation and free...\n");
+  static void *ptrs[BATCH_SIZE];
+  size_t sizes[] = {32, 200, 3000, 200 * 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t n = sizes[i] < 100000 ? BATCH_SIZE : 8;
+    assert(tinymalloc_batch(sizes[i], n, ptrs) == n);
+    for (size_t j = 0; j < n; j++) {
+      assert(ptrs[j] != NULL && ((uintptr_t)ptrs[j] & 15) == 0);
+      memset(ptrs[j], (int)j, sizes[i]);
+    }
+    for (size_t j = 0; j < n; j++) {
+      assert(((unsigned char *)ptrs[j])[0] == (unsigned char)j);
+      assert(((unsigned char *)ptrs[j])[sizes[i] - 1] == (unsigned char)j);
+      for (size_t k = j + 1; k < n; k++) {
+        assert(ptrs[j] != ptrs[k]);
+      }
+    }
+    tinyfree_batch(ptrs, n);
+  }
+
+  assert(tinymalloc_batch(0, BATCH_SIZE, ptrs) == 0);
+  tinyfree_batch(ptrs, 0);
+  printf("PASSED :-)\n\n");
+}
+
+static void *thread_free_batch(void *arg) {
+  tinyfree_batch(arg, BATCH_SIZE);
+  return NULL;
+}
+
+void test_cross_thread_batch_free() {
+  printf("testing batch free from another thread...\n");
+  static void *ptrs[BATCH_SIZE];
+  for (int round = 0; round < 4; round++) {
+    assert(tinymalloc_batch(round % 2 ? 64 : 2000, BATCH_SIZE, ptrs) ==
+           BATCH_SIZE);
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_free_batch, ptrs);
+    pthread_join(thread, NULL);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+void test_usable_size() {
+  printf("testing usable size...\n");
+  assert(tinymalloc_usable_size(NULL) == 0);
+  size_t sizes[] = {1, 100, 1000, 3000, 50000, 1024 * 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char *ptr = tinymalloc(sizes[i]);
+    assert(ptr != NULL);
+    size_t usable = tinymalloc_usable_size(ptr);
+    assert(usable >= sizes[i]);
+    memset(ptr, 0x44, usable);
+    tinyfree(ptr);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+void test_foreign_pointers() {
+  printf("testing foreign pointers...\n");
+  size_t sizes[] = {24, 3000, 50000, 1024 * 1024};
+  void *ptrs[4];
+  for (size_t i = 0; i < 4; i++) {
+    ptrs[i] = tinymalloc(sizes[i]);
+    assert(ptrs[i] != NULL && tinymalloc_owns(ptrs[i]));
+  }
+  // a large allocation moved by mremap is found at its new address
+  ptrs[3] = tinyrealloc(ptrs[3], 8 * 1024 * 1024);
+  assert(ptrs[3] != NULL && tinymalloc_owns(ptrs[3]));
+
+  static char global[64];
+  char local[64];
+  void *mapped = mmap(NULL, 8192, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(mapped != MAP_FAILED);
+  void *foreign[] = {global + 16, local + 16, (char *)mapped + 16};
+  for (size_t i = 0; i < 3; i++) {
+    assert(!tinymalloc_owns(foreign[i]));
+#ifndef TINYMALLOC_DEBUG
+    // rejected without their memory being touched
+    assert(tinymalloc_usable_size(foreign[i]) == 0);
+    tinyfree(foreign[i]);
+    tinyfree_sized(foreign[i], 48);
+    tinyfree_batch(&foreign[i], 1);
+    errno = 0;
+    assert(tinyrealloc(foreign[i], 100) == NULL && errno == EINVAL);
+#endif
+  }
+  assert(!tinymalloc_owns(NULL));
+  munmap(mapped, 8192);
+
+  // the slab region is reserved whole, but only what's carved is owned
+  char *uncarved = (char *)ptrs[0] + 512 * 1024 * 1024;
+  assert(!tinymalloc_owns(uncarved));
+#ifndef TINYMALLOC_DEBUG
+  assert(tinymalloc_usable_size(uncarved) == 0);
+  errno = 0;
+  assert(tinyrealloc(uncarved, 100) == NULL && errno == EINVAL);
+#endif
+
+  for (size_t i = 0; i < 4; i++) {
+    tinyfree(ptrs[i]);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+static atomic_int fork_stop = 0;
+
+static void *thread_churn(void *arg) {
+  (void)arg;
+  while (!atomic_load(&fork_stop)) {
+    void *ptr = tinymalloc(3000);
+    tinyfree(ptr);
+    ptr = tinymalloc(64);
+    tinyfree(ptr);
+  }
+  return NULL;
+}
+
+void test_fork() {
+  printf("testing fork while other threads allocate...\n");
+  pthread_t threads[NUM_THREADS];
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, thread_churn, NULL);
+  }
+
+  // no arena lock may be left held in the child
+  for (int i = 0; i < 20; i++) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      for (int j = 0; j < 1000; j++) {
+        void *ptr = tinymalloc(j % 2 ? 3000 : 64);
+        if (ptr == NULL) {
+          _exit(1);
+        }
+        tinyfree(ptr);
+      }
+      _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  atomic_store(&fork_stop, 1);
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+#define REGION_OBJECTS 10000
+
+void test_region() {
+  printf("testing regions...\n");
+  tiny_arena_t *region = tiny_arena_create(0);
+  assert(region != NULL);
+  assert(tiny_arena_alloc(region, 0) == NULL);
+
+  static char *objects[REGION_OBJECTS];
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < REGION_OBJECTS; i++) {
+      size_t size = 1 + i % 200;
+      objects[i] = tiny_arena_alloc(region, size);
+      assert(objects[i] != NULL && ((uintptr_t)objects[i] & 15) == 0);
+      memset(objects[i], i & 0xff, size);
+    }
+    for (int i = 0; i < REGION_OBJECTS; i++) {
+      assert(objects[i][i % 200] == (char)(i & 0xff));
+    }
+
+    // requests bigger than a chunk get one of their own
+    char *big = tiny_arena_alloc(region, 1024 * 1024);
+    assert(big != NULL);
+    memset(big, 0x99, 1024 * 1024);
+
+    // a reset hands out the same memory again
+    char *first = objects[0];
+    tiny_arena_reset(region);
+    assert(tiny_arena_alloc(region, 1) == first);
+    tiny_arena_reset(region);
+  }
+  tiny_arena_destroy(region);
+
+  // the chunks kept by a reset are smaller than the regular size has grown
+  // to since. a request that doesn't fit them must not overflow them, into
+  // the header of the next one
+  region = tiny_arena_create(0);
+  for (int i = 0; i < 128; i++) {
+    assert(tiny_arena_alloc(region, 8 * 1024) != NULL);
+  }
+  tiny_arena_reset(region);
+  char *grown = tiny_arena_alloc(region, 200 * 1024);
+  char *after = tiny_arena_alloc(region, 64);
+  assert(grown != NULL && after != NULL);
+  memset(grown, 0x5a, 200 * 1024);
+  memset(after, 0xa5, 64);
+  assert(grown[0] == 0x5a && after[63] == (char)0xa5);
+  tiny_arena_reset(region);
+  for (int i = 0; i < 128; i++) {
+    char *object = tiny_arena_alloc(region, 8 * 1024);
+    assert(object != NULL);
+    memset(object, i, 8 * 1024);
+  }
+  tiny_arena_destroy(region);
+  tiny_arena_destroy(NULL);
+  printf("PASSED :-)\n\n");
+}
+
+#define POOL_OBJECTS 5000
+#define POOL_THREADS 4
+
+void test_pool() {
+  printf("testing object pools...\n");
+  errno = 0;
+  assert(tiny_pool_create(0, 8) == NULL && errno == EINVAL);
+  assert(tiny_pool_create(24, 24) == NULL && errno == EINVAL);
+
+  for (int depth = 0; depth <= 64; depth += 64) {
+    tiny_pool_t *pool = tiny_pool_create(24, 64);
+    assert(pool != NULL);
+    assert(tiny_pool_set_magazine(pool, depth) == 0);
+
+    static char *objects[POOL_OBJECTS];
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+      objects[i] = tiny_pool_alloc(pool);
+      assert(objects[i] != NULL && ((uintptr_t)objects[i] & 63) == 0);
+      memset(objects[i], i & 0xff, 24);
+    }
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+      assert(objects[i][23] == (char)(i & 0xff));
+    }
+
+    // a freed object is the next one handed out
+    tiny_pool_free(pool, objects[7]);
+    assert(tiny_pool_alloc(pool) == objects[7]);
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+      tiny_pool_free(pool, objects[i]);
+    }
+    tiny_pool_free(pool, NULL);
+    tiny_pool_destroy(pool);
+  }
+
+  tiny_pool_t *pool = tiny_pool_create(8, 8);
+  assert(tiny_pool_set_magazine(pool, 1 << 20) == -1 && errno == EINVAL);
+  tiny_pool_destroy(pool);
+  tiny_pool_destroy(NULL);
+  printf("PASSED :-)\n\n");
+}
+
+static void *pool_worker(void *arg) {
+  tiny_pool_t *pool = arg;
+  void *objects[256];
+  for (int round = 0; round < 200; round++) {
+    for (int i = 0; i < 256; i++) {
+      objects[i] = tiny_pool_alloc(pool);
+      assert(objects[i] != NULL);
+      *(uintptr_t *)objects[i] = (uintptr_t)objects[i];
+    }
+    for (int i = 0; i < 256; i++) {
+      assert(*(uintptr_t *)objects[i] == (uintptr_t)objects[i]);
+      tiny_pool_free(pool, objects[i]);
+    }
+  }
+  // half are kept in this thread's magazine, they go back on exit
+  return tiny_pool_alloc(pool);
+}
+
+void test_pool_threads() {
+  printf("testing object pools across threads...\n");
+  tiny_pool_t *pool = tiny_pool_create(48, 16);
+  assert(pool != NULL);
+  assert(tiny_pool_set_magazine(pool, 32) == 0);
+
+  pthread_t threads[POOL_THREADS];
+  void *kept[POOL_THREADS];
+  for (int i = 0; i < POOL_THREADS; i++) {
+    assert(pthread_create(&threads[i], NULL, pool_worker, pool) == 0);
+  }
+  for (int i = 0; i < POOL_THREADS; i++) {
+    assert(pthread_join(threads[i], &kept[i]) == 0);
+  }
+
+  // objects allocated by a thread can be freed by another one
+  for (int i = 0; i < POOL_THREADS; i++) {
+    assert(kept[i] != NULL);
+    tiny_pool_free(pool, kept[i]);
+  }
+  tiny_pool_destroy(pool);
+
+  // a new pool doesn't see the magazines of a destroyed one
+  pool = tiny_pool_create(48, 16);
+  assert(tiny_pool_set_magazine(pool, 32) == 0);
+  void *ptr = tiny_pool_alloc(pool);
+  assert(ptr != NULL);
+  tiny_pool_free(pool, ptr);
+  tiny_pool_destroy(pool);
+  printf("PASSED :-)\n\n");
+}
+
 void test_free_null() {
   printf("testing free of NULL pointer...\n");
   tinyfree(NULL); // Should not crash
@@ -77,6 +831,7 @@ void test_write_to_allocated_memory() {
 
 void test_reuse_after_free() {
   printf("testing memory reuse after free...\n");
+  SKIP_IN_DEBUG_BUILDS();
   void *ptr1 = tinymalloc(100);
   tinyfree(ptr1);
   void *ptr2 = tinymalloc(100);
@@ -99,6 +854,45 @@ void test_fragmentation() {
   printf("PASSED :-)\n\n");
 }
 
+void test_size_class_reuse() {
+  printf("testing size class free list reuse...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  void *ptr1 = tinymalloc(64);
+  void *ptr2 = tinymalloc(200);
+  void *ptr3 = tinymalloc(64);
+  // ptr2 can't be merged with its in-use neighbours, so it should sit in
+  // its size class and be handed out again for the same size
+  tinyfree(ptr2);
+  void *ptr4 = tinymalloc(200);
+  assert(ptr4 == ptr2);
+  tinyfree(ptr1);
+  tinyfree(ptr3);
+  tinyfree(ptr4);
+  printf("PASSED :-)\n\n");
+}
+
+void test_slab_objects_have_no_header() {
+  printf("testing header-free slab objects...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  char *ptrs[64];
+  for (int i = 0; i < 64; i++) {
+    ptrs[i] = tinymalloc(16);
+    assert(ptrs[i] != NULL);
+  }
+  // slots of a fresh slab are handed out back to back
+  for (int i = 1; i < 64; i++) {
+    assert(ptrs[i] - ptrs[i - 1] == 16);
+  }
+  for (int i = 63; i >= 0; i--) {
+    tinyfree(ptrs[i]);
+  }
+  // the lowest slot, freed last, is the first to be handed out again
+  void *ptr = tinymalloc(16);
+  assert(ptr == ptrs[0]);
+  tinyfree(ptr);
+  printf("PASSED :-)\n\n");
+}
+
 void test_different_sizes() {
     printf("testing allocations of different sizes...\n");
     void *ptr1 = tinymalloc(10);
@@ -145,6 +939,517 @@ void test_multithreaded() {
     printf("PASSED :-)\n\n");
 }
 
+void test_tcache_depth() {
+  printf("testing thread cache depth tuning...\n");
+  assert(tinymalloc_set_tcache_depth(0, 8) == -1);
+  assert(tinymalloc_set_tcache_depth(4096, 8) == -1);
+  assert(tinymalloc_set_tcache_depth(48, 4) == 0);
+  void *ptrs[32];
+  for (int i = 0; i < 32; i++) {
+    ptrs[i] = tinymalloc(48);
+    assert(ptrs[i] != NULL);
+  }
+  // with a depth of 4 most of these go back to their slab right away
+  for (int i = 0; i < 32; i++) {
+    tinyfree(ptrs[i]);
+  }
+  assert(tinymalloc_set_tcache_depth(48, 0) == 0);
+  void *ptr = tinymalloc(48);
+  assert(ptr != NULL);
+  tinyfree(ptr);
+  assert(tinymalloc_set_tcache_depth(48, 64) == 0);
+  printf("PASSED :-)\n\n");
+}
+
+void *thread_alloc(void *arg) {
+  void **ptrs = arg;
+  for (int i = 0; i < ALLOCS_PER_THREAD; i++) {
+    ptrs[i] = tinymalloc(ALLOC_SIZE);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], i & 0xff, ALLOC_SIZE);
+  }
+  return NULL;
+}
+
+void test_cross_thread_free() {
+  printf("testing frees from another thread...\n");
+  static void *ptrs[ALLOCS_PER_THREAD];
+  pthread_t thread;
+  pthread_create(&thread, NULL, thread_alloc, ptrs);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < ALLOCS_PER_THREAD; i++) {
+    assert(((unsigned char *)ptrs[i])[ALLOC_SIZE - 1] == (i & 0xff));
+    tinyfree(ptrs[i]);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+void *thread_alloc_blocks(void *arg) {
+  void **ptrs = arg;
+  for (int i = 0; i < 100; i++) {
+    ptrs[i] = tinymalloc(2000 + i);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], 0xab, 2000 + i);
+  }
+  return NULL;
+}
+
+void *thread_reuse_blocks(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 100; i++) {
+    void *ptr = tinymalloc(2000 + i);
+    assert(ptr != NULL);
+    memset(ptr, 0xcd, 2000 + i);
+    tinyfree(ptr);
+  }
+  return NULL;
+}
+
+void test_cross_arena_free() {
+  printf("testing blocks freed outside their arena...\n");
+  static void *ptrs[100];
+  pthread_t threads[NUM_THREADS];
+  pthread_create(&threads[0], NULL, thread_alloc_blocks, ptrs);
+  pthread_join(threads[0], NULL);
+  // the blocks go back to the arena of the thread that allocated them
+  for (int i = 0; i < 100; i++) {
+    tinyfree(ptrs[i]);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_create(&threads[i], NULL, thread_reuse_blocks, NULL);
+  }
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+#define PIPELINE_LENGTH 10000
+
+static void *_Atomic pipeline[PIPELINE_LENGTH];
+
+void *thread_produce(void *arg) {
+  (void)arg;
+  for (int i = 0; i < PIPELINE_LENGTH; i++) {
+    size_t size = (i % 2) ? 64 : 3000;
+    char *ptr = tinymalloc(size);
+    assert(ptr != NULL);
+    ptr[0] = ptr[size - 1] = (char)i;
+    atomic_store(&pipeline[i], ptr);
+  }
+  return NULL;
+}
+
+void *thread_consume(void *arg) {
+  (void)arg;
+  for (int i = 0; i < PIPELINE_LENGTH; i++) {
+    char *ptr;
+    while ((ptr = atomic_load(&pipeline[i])) == NULL) {
+      sched_yield();
+    }
+    assert(ptr[0] == (char)i);
+    tinyfree(ptr);
+  }
+  return NULL;
+}
+
+void test_node_stats() {
+  printf("testing per-node stats...\n");
+  void *small = tinymalloc(64);
+  void *block = tinymalloc(8192);
+  assert(small != NULL && block != NULL);
+
+  unsigned int nodes = tinymalloc_numa_nodes();
+  assert(nodes >= 1);
+  size_t arenas = 0, segments = 0, slabs = 0;
+  for (unsigned int node = 0; node < nodes; node++) {
+    tinymalloc_node_stats_t stats;
+    assert(tinymalloc_node_stats(node, &stats) == 0);
+    arenas += stats.arenas;
+    segments += stats.segment_bytes;
+    slabs += stats.slab_bytes;
+  }
+  assert(arenas >= 1 && segments > 0 && slabs > 0);
+
+  tinymalloc_node_stats_t stats;
+  assert(tinymalloc_node_stats(nodes, &stats) == -1 && errno == EINVAL);
+  tinyfree(small);
+  tinyfree(block);
+  printf("PASSED :-)\n\n");
+}
+
+void test_stats() {
+  printf("testing stats...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  tinymalloc_stats_t before, after;
+  tinymalloc_stats(&before);
+  unsigned int c = 0;
+  while (before.classes[c].size != 64) {
+    c++;
+    assert(c < TINYMALLOC_STATS_CLASSES);
+  }
+
+  void *small = tinymalloc(64);
+  void *block = tinymalloc(8192);
+  void *large = tinymalloc(1 << 20);
+  assert(small != NULL && block != NULL && large != NULL);
+  tinymalloc_stats(&after);
+  assert(after.classes[c].allocs == before.classes[c].allocs + 1);
+  assert(after.classes[TINYMALLOC_STATS_CLASSES - 2].allocs ==
+         before.classes[TINYMALLOC_STATS_CLASSES - 2].allocs + 1);
+  assert(after.classes[TINYMALLOC_STATS_CLASSES - 1].allocs ==
+         before.classes[TINYMALLOC_STATS_CLASSES - 1].allocs + 1);
+  assert(after.allocated >= before.allocated + 64 + 8192 + (1 << 20));
+  assert(after.mapped >= after.allocated + after.free);
+  assert(after.mmap_calls > 0);
+
+  tinyfree(small);
+  tinyfree(block);
+  tinyfree(large);
+  tinymalloc_stats(&after);
+  assert(after.classes[c].frees == before.classes[c].frees + 1);
+  assert(after.allocated == before.allocated);
+  assert(after.munmap_calls > before.munmap_calls);
+  printf("PASSED :-)\n\n");
+}
+
+void test_ctl() {
+  printf("testing ctl...\n");
+  size_t allocated, len = sizeof(allocated);
+  assert(tinymalloc_ctl("stats.allocated", &allocated, &len, NULL, 0) == 0);
+  unsigned int classes;
+  len = sizeof(classes);
+  assert(tinymalloc_ctl("stats.classes", &classes, &len, NULL, 0) == 0);
+  assert(classes == TINYMALLOC_STATS_CLASSES);
+  size_t size;
+  len = sizeof(size);
+  assert(tinymalloc_ctl("stats.class.0.size", &size, &len, NULL, 0) == 0);
+  assert(size > 0);
+
+  unsigned int decay, new_decay = 250;
+  len = sizeof(decay);
+  assert(tinymalloc_ctl("opt.decay_ms", &decay, &len, &new_decay,
+                        sizeof(new_decay)) == 0);
+  unsigned int current;
+  assert(tinymalloc_ctl("opt.decay_ms", &current, &len, &decay,
+                        sizeof(decay)) == 0);
+  assert(current == 250);
+
+  len = sizeof(allocated);
+  assert(tinymalloc_ctl("stats.nothing", &allocated, &len, NULL, 0) == ENOENT);
+  assert(tinymalloc_ctl("stats.class.99.size", &size, &len, NULL, 0) ==
+         ENOENT);
+  assert(tinymalloc_ctl("stats.allocated", NULL, NULL, &allocated,
+                        sizeof(allocated)) == EPERM);
+  len = sizeof(classes);
+  assert(tinymalloc_ctl("stats.allocated", &allocated, &len, NULL, 0) ==
+         EINVAL);
+  printf("PASSED :-)\n\n");
+}
+
+// reads the totals off the header of a heap profile
+static void profile_totals(unsigned long long *live,
+                           unsigned long long *allocs) {
+  FILE *file = tmpfile();
+  assert(file != NULL);
+  assert(tinymalloc_profile_dump(fileno(file)) == 0);
+  rewind(file);
+  unsigned long long live_bytes, alloc_bytes;
+  size_t interval;
+  assert(fscanf(file, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu",
+                live, &live_bytes, allocs, &alloc_bytes, &interval) == 5);
+  assert(*live == 0 || live_bytes > 0);
+  char line[256];
+  bool maps = false;
+  while (fgets(line, sizeof(line), file)) {
+    maps = maps || strcmp(line, "MAPPED_LIBRARIES:\n") == 0;
+  }
+  assert(maps);
+  fclose(file);
+}
+
+void test_profile() {
+  printf("testing heap profile...\n");
+  SKIP_IN_DEBUG_BUILDS();
+  unsigned long long live, allocs, live_after, allocs_after;
+  profile_totals(&live, &allocs);
+
+  // with a 1 byte interval, every allocation after the first is sampled
+  tinymalloc_set_sample_interval(1);
+  void *ptrs[8];
+  for (int i = 0; i < 8; i++) {
+    ptrs[i] = tinymalloc(64 + i);
+    assert(ptrs[i] != NULL);
+    memset(ptrs[i], i, 64 + i);
+  }
+  void *large = tinymalloc(1 << 20);
+  assert(large != NULL);
+  tinymalloc_set_sample_interval(0);
+  profile_totals(&live_after, &allocs_after);
+  assert(live_after >= live + 8 && allocs_after >= allocs + 8);
+
+  // a sample that's resized moves, and isn't recorded anymore
+  ptrs[1] = tinyrealloc(ptrs[1], 100);
+  assert(((char *)ptrs[1])[64] == 1);
+  for (int i = 0; i < 8; i++) {
+    tinyfree(ptrs[i]);
+  }
+  tinyfree(large);
+  profile_totals(&live_after, &allocs_after);
+  assert(live_after == live && allocs_after >= allocs + 8);
+
+  // a batch runs the countdown down like as many single calls
+  tinymalloc_set_sample_interval(1);
+  void *batch[16];
+  assert(tinymalloc_batch(48, 16, batch) == 16);
+  tinymalloc_set_sample_interval(0);
+  profile_totals(&live_after, &allocs_after);
+  assert(live_after >= live + 8);
+  tinyfree_batch(batch, 16);
+  profile_totals(&live_after, &allocs_after);
+  assert(live_after == live);
+  printf("PASSED :-)\n\n");
+}
+
+#ifdef TINYMALLOC_DEBUG
+// runs a misuse in a child, which has to abort
+static void expect_abort(void (*misuse)(void)) {
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    misuse();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+static void overflow_by_one() {
+  char *ptr = tinymalloc(24);
+  ptr[24] = 'x';
+  tinyfree(ptr);
+}
+
+static void free_twice() {
+  void *ptr = tinymalloc(64);
+  tinyfree(ptr);
+  tinyfree(ptr);
+}
+
+static void write_after_free() {
+  char *ptr = tinymalloc(64);
+  tinyfree(ptr);
+  ptr[8] = 1;
+  // the write is found once the quarantine lets go of it
+  for (int i = 0; i < 4096; i++) {
+    tinyfree(tinymalloc(64));
+  }
+}
+
+static void free_wrong_size() {
+  void *ptr = tinymalloc(40);
+  tinyfree_sized(ptr, 48);
+}
+
+static void free_foreign() {
+  static char global[64];
+  tinyfree(global + 32);
+}
+
+// into the slab region, past the slabs carved so far
+static void free_uncarved() {
+  char *ptr = tinymalloc(24);
+  tinyfree(ptr + 512 * 1024 * 1024);
+}
+#endif
+
+#define LATE_THREADS 16
+#define LATE_SIZE 3000
+
+static pthread_key_t late_key;
+
+static void late_free(void *ptr) { tinyfree(ptr); }
+
+static void *thread_free_late(void *arg) {
+  (void)arg;
+  void *ptr = tinymalloc(LATE_SIZE);
+  assert(ptr != NULL);
+  memset(ptr, 0x42, LATE_SIZE);
+  pthread_setspecific(late_key, ptr);
+  return NULL;
+}
+
+void test_free_after_teardown() {
+  printf("testing frees from later thread key destructors...\n");
+  // the key is made after the allocator's, so its destructor runs after
+  // the thread's cache is torn down
+  tinyfree(tinymalloc(8));
+  assert(pthread_key_create(&late_key, late_free) == 0);
+  tinymalloc_stats_t before, after;
+  tinymalloc_stats(&before);
+  for (int i = 0; i < LATE_THREADS; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_free_late, NULL);
+    pthread_join(thread, NULL);
+  }
+  tinymalloc_stats(&after);
+  assert(after.allocated < before.allocated + LATE_SIZE);
+  pthread_key_delete(late_key);
+  printf("PASSED :-)\n\n");
+}
+
+void test_debug_checks() {
+  printf("testing debug checks...\n");
+  FILE *file = tmpfile();
+  assert(file != NULL);
+#ifdef TINYMALLOC_DEBUG
+  expect_abort(overflow_by_one);
+  expect_abort(free_twice);
+  expect_abort(write_after_free);
+  expect_abort(free_wrong_size);
+  expect_abort(free_foreign);
+  expect_abort(free_uncarved);
+
+  char *leak = tinymalloc(123);
+  assert(leak != NULL);
+  size_t leaks = tinymalloc_leak_dump(fileno(file));
+  assert(leaks >= 1);
+  tinyfree(leak);
+  assert(tinymalloc_leak_dump(fileno(file)) == leaks - 1);
+
+  rewind(file);
+  char line[128];
+  bool found = false;
+  while (fgets(line, sizeof(line), file)) {
+    found = found || strstr(line, "leaked 123 bytes") != NULL;
+  }
+  assert(found);
+#else
+  assert(tinymalloc_leak_dump(fileno(file)) == 0);
+#endif
+  fclose(file);
+  printf("PASSED :-)\n\n");
+}
+
+// run by test_conf in a fresh process, configured through TINYMALLOC_CONF
+// or, before allocating, by tinymalloc_set_conf
+static int conf_child(bool set) {
+  const char *conf = "arenas:3,segment_initial:256k,decay_ms:5";
+  if (set && tinymalloc_set_conf(conf) != 0) {
+    return 1;
+  }
+  void *block = tinymalloc(8192);
+  assert(block != NULL);
+  size_t arenas = 0, segments = 0;
+  for (unsigned int node = 0; node < tinymalloc_numa_nodes(); node++) {
+    tinymalloc_node_stats_t stats;
+    assert(tinymalloc_node_stats(node, &stats) == 0);
+    arenas += stats.arenas;
+    segments += stats.segment_bytes;
+  }
+  unsigned int decay;
+  size_t len = sizeof(decay);
+  assert(tinymalloc_ctl("opt.decay_ms", &decay, &len, NULL, 0) == 0);
+  tinyfree(block);
+  return arenas == 3 && segments == 256 * 1024 && decay == 5 ? 0 : 1;
+}
+
+void test_conf() {
+  printf("testing configuration...\n");
+  unsigned int decay;
+  size_t threshold, len = sizeof(decay);
+  assert(tinymalloc_ctl("opt.decay_ms", &decay, &len, NULL, 0) == 0);
+  len = sizeof(threshold);
+  assert(tinymalloc_ctl("opt.large_threshold", &threshold, &len, NULL, 0) ==
+         0);
+
+  assert(tinymalloc_set_conf("decay_ms:250,large_threshold:256k") == 0);
+  unsigned int new_decay;
+  size_t new_threshold;
+  len = sizeof(new_decay);
+  assert(tinymalloc_ctl("opt.decay_ms", &new_decay, &len, NULL, 0) == 0);
+  len = sizeof(new_threshold);
+  assert(tinymalloc_ctl("opt.large_threshold", &new_threshold, &len, NULL,
+                        0) == 0);
+  assert(new_decay == 250 && new_threshold == 256 * 1024);
+
+  // the arenas are set up already, bad pairs don't stop the good ones
+  assert(tinymalloc_set_conf("arenas:4") == -1 && errno == EBUSY);
+  assert(tinymalloc_set_conf("bogus:1") == -1 && errno == EINVAL);
+  assert(tinymalloc_set_conf("decay_ms:soon") == -1 && errno == EINVAL);
+  assert(tinymalloc_set_conf("tcache_depth:5000,decay_ms:7") == -1 &&
+         errno == EINVAL);
+  len = sizeof(new_decay);
+  assert(tinymalloc_ctl("opt.decay_ms", &new_decay, &len, NULL, 0) == 0);
+  assert(new_decay == 7);
+  tinymalloc_set_decay(decay);
+  assert(tinymalloc_set_large_threshold(threshold) == 0);
+
+  // options read at init are tried on new processes, from the environment
+  // and from the program before its first allocation
+  for (int set = 0; set < 2; set++) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      if (set) {
+        unsetenv("TINYMALLOC_CONF");
+      } else {
+        setenv("TINYMALLOC_CONF", "arenas:3,segment_initial:256k,decay_ms:5",
+               1);
+      }
+      execl("/proc/self/exe", "test_tinymalloc",
+            set ? "set-conf-child" : "conf-child", (char *)NULL);
+      _exit(2);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  printf("PASSED :-)\n\n");
+}
+
+void test_producer_consumer() {
+  printf("testing producer/consumer frees...\n");
+  pthread_t producer, consumer;
+  pthread_create(&consumer, NULL, thread_consume, NULL);
+  pthread_create(&producer, NULL, thread_produce, NULL);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  printf("PASSED :-)\n\n");
+}
+
+void test_trace_dump() {
+  printf("testing trace dump...\n");
+  void *ptr = tinymalloc(100);
+  assert(ptr != NULL);
+  tinyfree(ptr);
+
+  FILE *file = tmpfile();
+  assert(file != NULL);
+  size_t records = tinymalloc_trace_dump(fileno(file));
+#ifdef TINYMALLOC_TRACE
+  // the allocation above must be among the records of this thread
+  assert(records > 0);
+  rewind(file);
+  tinymalloc_trace_record_t record;
+  int found = 0;
+  while (fread(&record, sizeof(record), 1, file) == 1) {
+    if (record.event == TINYMALLOC_TRACE_MALLOC &&
+        record.ptr == (uint64_t)(uintptr_t)ptr && record.size == 100) {
+      found = 1;
+    }
+  }
+  assert(found);
+#else
+  assert(records == 0);
+#endif
+  fclose(file);
+  printf("PASSED :-)\n\n");
+}
+
 void test_boundary_conditions() {
     printf("testing boundary conditions...\n");
     void* ptr1 = tinymalloc(1);
@@ -155,18 +1460,62 @@ void test_boundary_conditions() {
     printf("PASSED :-)\n\n");
 }
 
-int main() {
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "conf-child") == 0) {
+    return conf_child(false);
+  }
+  if (argc > 1 && strcmp(argv[1], "set-conf-child") == 0) {
+    return conf_child(true);
+  }
+
   test_basic_alloc_and_free();
   test_multiple_allocs();
   test_alloc_zero_size();
   test_alloc_large_size();
+  test_large_alloc_unmapped();
+  test_large_threshold();
+  test_heap_growth();
+  test_huge_pages();
+  test_block_header_overhead();
+  test_coalesce_neighbours();
+  test_deferred_coalescing();
+  test_trim();
+  test_decay();
+  test_realloc_in_place();
+  test_realloc_across_paths();
+  test_calloc();
+  test_aligned_alloc();
+  test_posix_memalign();
+  test_free_sized();
+  test_batch();
+  test_cross_thread_batch_free();
+  test_usable_size();
+  test_foreign_pointers();
+  test_fork();
+  test_region();
+  test_pool();
+  test_pool_threads();
   test_free_null();
   test_write_to_allocated_memory();
   test_reuse_after_free();
   test_fragmentation();
+  test_size_class_reuse();
+  test_slab_objects_have_no_header();
   test_different_sizes();
   test_alignment();
   test_multithreaded();
+  test_tcache_depth();
+  test_cross_thread_free();
+  test_cross_arena_free();
+  test_producer_consumer();
+  test_node_stats();
+  test_stats();
+  test_ctl();
+  test_profile();
+  test_free_after_teardown();
+  test_debug_checks();
+  test_conf();
+  test_trace_dump();
   test_boundary_conditions();
 
   printf("all tests passed successfully! :-)\n");
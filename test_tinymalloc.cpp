@@ -0,0 +1,140 @@
+#include "tinymalloc.hpp"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+// over-aligned, so the allocator and new take their aligned paths
+struct alignas(128) Wide {
+  char bytes[200];
+};
+
+void test_allocator() {
+  printf("testing the STL allocator...\n");
+  std::vector<int, tinymalloc::allocator<int>> ints;
+  for (int i = 0; i < 10000; i++) {
+    ints.push_back(i);
+  }
+  assert(tinymalloc_owns(ints.data()));
+  for (int i = 0; i < 10000; i++) {
+    assert(ints[i] == i);
+  }
+
+  using pair = std::pair<const int, std::string>;
+  std::map<int, std::string, std::less<int>, tinymalloc::allocator<pair>>
+      strings;
+  for (int i = 0; i < 1000; i++) {
+    strings[i] = std::string(i % 50, 'x');
+  }
+  assert(strings.size() == 1000 && strings[49] == std::string(49, 'x'));
+
+  std::vector<Wide, tinymalloc::allocator<Wide>> wide(10);
+  assert(tinymalloc_owns(wide.data()));
+  assert(((uintptr_t)wide.data() & 127) == 0);
+  printf("PASSED :-)\n\n");
+}
+
+void test_new_and_delete() {
+  printf("testing operator new and delete...\n");
+  int *one = new int(7);
+  int *many = new int[100];
+  assert(tinymalloc_owns(one) && tinymalloc_owns(many));
+  many[99] = *one;
+  delete one;
+  delete[] many;
+
+  // sized deletes, which the debug build checks against the real size
+  std::string *string = new std::string(1000, 'y');
+  assert(tinymalloc_owns(string));
+  delete string;
+  for (size_t size = 1; size <= 4096; size *= 2) {
+    void *ptr = ::operator new(size);
+    assert(tinymalloc_owns(ptr));
+    ::operator delete(ptr, size);
+  }
+  ::operator delete(::operator new(0), (size_t)0);
+
+  // aligned ones, sized or not
+  void *aligned = ::operator new(64, std::align_val_t(64));
+  assert(tinymalloc_owns(aligned) && ((uintptr_t)aligned & 63) == 0);
+  ::operator delete(aligned, 64, std::align_val_t(64));
+  aligned = ::operator new[](1000, std::align_val_t(64));
+  assert(((uintptr_t)aligned & 63) == 0);
+  ::operator delete[](aligned, std::align_val_t(64));
+  Wide *wide = new Wide[3];
+  assert(tinymalloc_owns(wide) && ((uintptr_t)wide & 127) == 0);
+  delete[] wide;
+  printf("PASSED :-)\n\n");
+}
+
+void test_nothrow() {
+  printf("testing nothrow new...\n");
+  char *small = new (std::nothrow) char[100];
+  assert(small != nullptr && tinymalloc_owns(small));
+  delete[] small;
+  void *aligned = ::operator new(100, std::align_val_t(64), std::nothrow);
+  assert(aligned != nullptr && ((uintptr_t)aligned & 63) == 0);
+  ::operator delete(aligned, std::align_val_t(64), std::nothrow);
+
+  // what can't be had is a null pointer for these, an exception otherwise
+  const size_t huge = (size_t)1 << 62;
+  assert(new (std::nothrow) char[huge] == nullptr);
+  assert(::operator new(huge, std::align_val_t(64), std::nothrow) == nullptr);
+  bool thrown = false;
+  try {
+    char *volatile ptr = new char[huge];
+    (void)ptr;
+  } catch (std::bad_alloc &) {
+    thrown = true;
+  }
+  assert(thrown);
+  printf("PASSED :-)\n\n");
+}
+
+static int handler_calls;
+
+// gives up on its second call
+static void new_handler() {
+  if (++handler_calls == 2) {
+    std::set_new_handler(nullptr);
+  }
+}
+
+void test_new_handler() {
+  printf("testing the new handler...\n");
+  std::set_new_handler(new_handler);
+  assert(new (std::nothrow) char[(size_t)1 << 62] == nullptr);
+  assert(handler_calls == 2);
+  printf("PASSED :-)\n\n");
+}
+
+void test_threads() {
+  printf("testing new and delete across threads...\n");
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] {
+      for (int i = 0; i < 100000; i++) {
+        delete new std::string(i % 200, 'z');
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  printf("PASSED :-)\n\n");
+}
+
+int main() {
+  test_allocator();
+  test_new_and_delete();
+  test_nothrow();
+  test_new_handler();
+  test_threads();
+
+  printf("all tests passed successfully! :-)\n");
+  return 0;
+}
@@ -1,173 +1,4437 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_getcpu
+#endif
 #include "tinymalloc.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// glibc 2.35+ registers an rseq area for every thread, whose cpu_id field
+// the kernel keeps up to date: reading it is cheaper than sched_getcpu()
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define TINYMALLOC_HAVE_RSEQ 1
+#endif
+#endif
+
+// the heap profiler records backtraces with glibc's backtrace()
+#if defined(__has_include)
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define TINYMALLOC_HAVE_BACKTRACE 1
+#endif
+#endif
 
-#define HEAP_SIZE (1024 * 1024)
 #define ALIGNMENT _Alignof(max_align_t)
 
-/* Block Structure */
-typedef struct memory_block {
-  size_t size;
-  struct memory_block *next;
-  struct memory_block *prev;
-  int is_free;
-} memory_block_t;
+// thread-local state uses the initial-exec model, whose accesses never
+// allocate. the default model for shared libraries may call malloc, which
+// would recurse into tinymalloc when it's preloaded as the process malloc
+#if defined(__GNUC__)
+#define TM_TLS _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define TM_TLS _Thread_local
+#endif
+
+/* Tracing */
+// building with TINYMALLOC_TRACE makes TM_TRACE append a fixed-size binary
+// record to a ring buffer of the calling thread. rings are written by their
+// thread only and never lock, and they are kept after their thread exits,
+// so tinymalloc_trace_dump can write all of them out after the fact.
+// without TINYMALLOC_TRACE every TM_TRACE compiles to nothing
+#ifdef TINYMALLOC_TRACE
+#define TRACE_RING_RECORDS 4096 // a power of two
+
+typedef struct trace_ring {
+  struct trace_ring *next; // list of all rings ever created
+  uint32_t thread;
+  _Atomic uint64_t head; // records written so far
+  tinymalloc_trace_record_t records[TRACE_RING_RECORDS];
+} trace_ring_t;
+
+static trace_ring_t *_Atomic trace_rings = NULL;
+static _Atomic uint32_t trace_threads = 0;
+static TM_TLS trace_ring_t *thread_ring = NULL;
+static TM_TLS bool thread_ring_failed = false;
+
+/* trace_ring_create */
+// rings are mapped directly, tracing must never call back into malloc
+static trace_ring_t *trace_ring_create() {
+  trace_ring_t *ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    thread_ring_failed = true;
+    return NULL;
+  }
+
+  ring->thread = atomic_fetch_add(&trace_threads, 1);
+  trace_ring_t *head = atomic_load(&trace_rings);
+  do {
+    ring->next = head;
+  } while (!atomic_compare_exchange_weak(&trace_rings, &head, ring));
+
+  thread_ring = ring;
+  return ring;
+}
+
+/* trace_record */
+static void trace_record(uint16_t event, const void *ptr, size_t size,
+                         uint64_t aux) {
+  trace_ring_t *ring = thread_ring;
+  if (ring == NULL && (thread_ring_failed || !(ring = trace_ring_create()))) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  tinymalloc_trace_record_t *record =
+      &ring->records[head & (TRACE_RING_RECORDS - 1)];
+  record->timestamp = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+  record->ptr = (uint64_t)(uintptr_t)ptr;
+  record->size = size;
+  record->aux = aux;
+  record->thread = ring->thread;
+  record->event = event;
+  record->reserved = 0;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define TM_TRACE(event, ptr, size, aux)                                        \
+  trace_record(TINYMALLOC_TRACE_##event, (ptr), (size), (uint64_t)(aux))
+#else
+// the arguments are never evaluated, only kept from looking unused
+#define TM_TRACE(event, ptr, size, aux)                                        \
+  ((void)sizeof(ptr), (void)sizeof(size), (void)sizeof(aux))
+#endif
+
+/* write_all */
+static bool write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+/* tinymalloc_trace_dump */
+// writes the records of every ring, oldest first, and returns how many
+// were written. records overwritten while dumping may come out torn
+size_t tinymalloc_trace_dump(int fd) {
+#ifdef TINYMALLOC_TRACE
+  size_t written = 0;
+
+  for (trace_ring_t *ring = atomic_load(&trace_rings); ring;
+       ring = ring->next) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+
+    for (uint64_t i = first; i < head; i++) {
+      const char *record =
+          (const char *)&ring->records[i & (TRACE_RING_RECORDS - 1)];
+      if (!write_all(fd, record, sizeof(tinymalloc_trace_record_t))) {
+        return written;
+      }
+      written++;
+    }
+  }
+
+  return written;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
+
+/* Block Structure */
+// a block starts with a single boundary tag word: its size, header
+// included and a multiple of ALIGNMENT, with flags in the low four bits and
+// the index of the arena owning it in the top byte. a free block repeats
+// its size in a footer, its last word, and the block after it has
+// PREV_IN_USE clear, so both physical neighbours of any block are found in
+// O(1). in-use blocks have no footer, their payload runs up to the next tag.
+// blocks carved from fresh mappings are ZEROED: all their bytes but their
+// tag, free-list links and footer are zero, which tinycalloc exploits.
+// free blocks whose inner pages were given back to the OS are PURGED, and
+// blocks recorded by the heap profiler are SAMPLED, a bit above the size
+typedef struct block_header {
+  uint64_t tag;
+} memory_block_t;
+
+#define TAG_IN_USE ((uint64_t)1)
+#define TAG_PREV_IN_USE ((uint64_t)2)
+#define TAG_ZEROED ((uint64_t)4) // free block whose payload is known zero
+#define TAG_PURGED ((uint64_t)8) // free block whose pages went back
+#define TAG_FLAGS ((uint64_t)0xf)
+#define TAG_SIZE_MASK ((((uint64_t)1 << 48) - 1) & ~TAG_FLAGS)
+#define TAG_SAMPLED ((uint64_t)1 << 48) // in-use block the profiler records
+#define TAG_ARENA_SHIFT 56
+
+_Static_assert(ALIGNMENT > TAG_FLAGS, "block sizes leave no room for flags");
+
+/* Segments */
+// an arena's heap is a list of segments, each one mmap region holding a
+// run of physically adjacent blocks. the last word of a segment is a fence,
+// the tag of an empty in-use block, so walking to a neighbour never leaves
+// the segment and blocks of different regions are never merged. a segment is
+// mapped only when no free block fits, and each new one is twice the size
+// of the previous, up to segment_max_size, so an arena that keeps growing
+// makes a logarithmic number of mmap calls
+#define SEGMENT_INITIAL_SIZE (1024 * 1024)
+#define SEGMENT_MAX_SIZE (64 * 1024 * 1024)
+#define SEGMENT_MIN_SIZE (64 * 1024) // the smallest size that can be set
+
+static size_t segment_initial_size = SEGMENT_INITIAL_SIZE;
+static size_t segment_max_size = SEGMENT_MAX_SIZE;
+
+// with huge pages on, segments are whole huge pages aligned to one, so the
+// kernel can back them with huge pages. explicit huge pages (MAP_HUGETLB)
+// fall back to transparent ones (MADV_HUGEPAGE) if none can be had, and
+// those to small pages where the kernel doesn't have them
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+static _Atomic int huge_pages = TINYMALLOC_HUGE_NONE;
+
+typedef struct segment {
+  struct segment *next; // segments of the same arena, newest first
+  size_t size;          // bytes mapped, this header included
+} segment_t;
+
+// offset of the first block of a segment, whose payload is aligned
+#define SEGMENT_HEADER                                                         \
+  (((sizeof(segment_t) + sizeof(memory_block_t) + ALIGNMENT - 1) &             \
+    ~(ALIGNMENT - 1)) -                                                        \
+   sizeof(memory_block_t))
+
+/* Free List Links */
+// free blocks keep their free-list links in the first bytes of the payload,
+// so the header doesn't grow and in-use blocks pay nothing for them
+typedef struct free_links {
+  memory_block_t *next_free;
+  memory_block_t *prev_free;
+} free_links_t;
+
+/* Size Classes */
+// small bins hold exactly one size each (a multiple of ALIGNMENT up to
+// SMALL_BIN_MAX), the remaining bins hold power-of-two ranges
+// [2^k, 2^(k+1)). one bit per bin in binmap tells if the bin is non-empty
+#define NUM_SMALL_BINS 32
+#define NUM_BINS 64
+#define SMALL_BIN_MAX (NUM_SMALL_BINS * ALIGNMENT)
+
+// a free block must be able to hold its tag, free-list links and footer
+#define MIN_BLOCK                                                              \
+  ((sizeof(memory_block_t) + sizeof(free_links_t) + sizeof(uint64_t) +         \
+    ALIGNMENT - 1) &                                                           \
+   ~(ALIGNMENT - 1))
+
+/* Slab Allocator */
+// objects up to SLAB_MAX bytes live in fixed-size slabs, one size class per
+// slab, with no per-object header. a slab starts with a slab_t whose
+// occupancy bitmap has one bit per slot (1 = in use). slabs are carved from
+// one reserved address range, so a pointer is a slab object iff it falls in
+// that range, and its slab is found by masking off the low bits. the range
+// is split into one part per NUMA node, as large as a power of two allows,
+// and a slab is carved from the part of its arena's node
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX 1024
+#define SLAB_MIN_OBJECT 16
+#define SLAB_REGION_SHIFT 30
+#define SLAB_REGION_SIZE ((size_t)1 << SLAB_REGION_SHIFT)
+#define NUM_SLAB_CLASSES 20
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLAB_MIN_OBJECT / 64)
+
+typedef struct slab {
+  struct slab *next; // partial list of its class, or the empty slab list
+  struct slab *prev;
+  struct arena *arena; // arena owning the slab
+  uint32_t class_idx;
+  uint32_t object_size;
+  uint32_t nslots;
+  uint32_t nfree;
+  uint32_t hint; // first bitmap word that may have a free slot
+  bool purged;   // empty, with its pages given back by a trim
+  uint64_t bitmap[SLAB_BITMAP_WORDS];
+} slab_t;
+
+// slot data starts on the first cache line after the slab header
+#define SLAB_DATA_OFFSET ((sizeof(slab_t) + 63) & ~(size_t)63)
+
+// 16-byte steps up to 128, then four classes per doubling up to SLAB_MAX
+static const uint32_t slab_class_size[NUM_SLAB_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024};
+
+// read without any lock by tinyfree, so it's published atomically
+static char *_Atomic slab_region = NULL;
+
+/* Large Allocations */
+// requests of at least large_threshold bytes bypass the arenas: each gets
+// its own page-aligned mapping, which isn't linked into any block list and
+// is unmapped as soon as it's freed. their tag records ARENA_LARGE as the
+// owner, so tinyfree tells them apart without taking any lock, and the
+// whole mapping as their size. the mapping starts at the page holding it
+#ifndef TINYMALLOC_LARGE_THRESHOLD
+#define TINYMALLOC_LARGE_THRESHOLD (128 * 1024)
+#endif
+#define ARENA_LARGE 0xff // fits the arena byte of a tag
+
+static _Atomic size_t large_threshold = TINYMALLOC_LARGE_THRESHOLD;
+static size_t page_size = 4096;
+
+/* Page Map */
+// a two-level radix tree with a byte for every 4 KiB page of the address
+// space, saying what the allocator put there: a heap segment, a large
+// mapping or nothing. any pointer is looked up in it before the tag in
+// front of it is trusted, so memory tinymalloc never handed out is told
+// apart and rejected. slabs don't need it, their reserved range says it
+// already. a leaf covers 1 GiB and is mapped the first time something is
+// registered in its range, and pages of the root or of a leaf that are
+// never written take no memory
+#define PAGEMAP_SHIFT 12
+#define PAGEMAP_ADDRESS_BITS 48
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS                                                      \
+  (PAGEMAP_ADDRESS_BITS - PAGEMAP_SHIFT - PAGEMAP_LEAF_BITS)
+#define PAGEMAP_LEAF_PAGES ((uintptr_t)1 << PAGEMAP_LEAF_BITS)
+
+enum { PAGE_FOREIGN, PAGE_HEAP, PAGE_LARGE };
+
+typedef struct pagemap_leaf {
+  _Atomic uint8_t pages[PAGEMAP_LEAF_PAGES];
+} pagemap_leaf_t;
+
+static pagemap_leaf_t *_Atomic pagemap_root[(size_t)1 << PAGEMAP_ROOT_BITS];
+
+/* Decay */
+// free runs of at least PURGE_MIN_RUN bytes hold pages nobody uses. the
+// first such run coalescing leaves in an arena starts a decay epoch of
+// decay_ms milliseconds, at whose end every dirty run of the arena gives
+// the whole pages inside it back with MADV_FREE and is marked PURGED. a
+// purged run keeps its address range and is still reused, but only when
+// no run with committed pages fits. tinymalloc_trim purges every run right
+// away with MADV_DONTNEED instead, which drops them from the RSS at once
+#ifndef TINYMALLOC_DECAY_MS
+#define TINYMALLOC_DECAY_MS 1000
+#endif
+#define PURGE_MIN_RUN (64 * 1024)
+
+static _Atomic unsigned int decay_ms = TINYMALLOC_DECAY_MS;
+
+/* Deferred Coalescing */
+// with deferred_coalescing set, heap blocks under PURGE_MIN_RUN bytes
+// aren't merged with their neighbours when they're freed. they keep their
+// in-use tag, so nothing merges into them either, and are pushed on the
+// quick list of their bin, where a request of about their size takes one
+// back without going through the free lists, as with dlmalloc's fastbins.
+// coalesce() merges all of an arena's deferred blocks in one pass, once it
+// has deferred that many, when a request finds no block anywhere, and
+// before a trim. 0, the default, merges every block as it's freed
+#ifndef TINYMALLOC_DEFERRED_COALESCING
+#define TINYMALLOC_DEFERRED_COALESCING 0
+#endif
+#define QUICK_SCAN 4 // quick list entries looked at per request
+
+static _Atomic unsigned int deferred_coalescing =
+    TINYMALLOC_DEFERRED_COALESCING;
+
+/* Arenas */
+// the heap is split into independent arenas, each with its own lock, block
+// lists and slabs. where the current CPU can be read, a thread allocates
+// from the arena of the CPU it runs on. otherwise threads are assigned an
+// arena round-robin the first time they allocate, and a thread that keeps
+// finding its arena's lock taken moves to the arena with the fewest threads.
+// blocks and slabs record their owner. frees of memory owned by another
+// arena never take its lock: they're pushed onto its lock-free remote-free
+// queue, which the owner drains the next time it allocates.
+// within an arena, the block heap and each slab size class have a lock and
+// a remote-free queue of their own, so that cache refills and flushes of
+// different classes, and coalescing, never wait on each other. a class
+// lock never nests in the heap lock nor the other way around. empty slabs
+// are shared by the classes under slab_lock, taken last
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 4
+static unsigned int conf_arenas; // set by the configuration, 0 if not
+#define ARENA_CONTENTION_LIMIT 64
+// a freeing thread that pushes this many objects onto a remote queue tries
+// to drain it itself, in case the owner doesn't allocate anymore
+#define REMOTE_DRAIN_THRESHOLD 256
+
+enum { ARENA_PER_THREAD, ARENA_PER_CPU };
+
+// objects freed by other arenas' threads, linked through their first word
+typedef struct remote_queue {
+  void *_Atomic head;
+  _Atomic unsigned int count;
+} remote_queue_t;
+
+// the slabs of one size class of an arena, on a cache line of their own
+typedef struct slab_bin {
+  _Alignas(64) pthread_mutex_t lock;
+  slab_t *partial; // slabs with free slots
+  remote_queue_t remote;
+} slab_bin_t;
+
+typedef struct arena {
+  pthread_mutex_t lock; // the block heap's
+  unsigned int index;
+  unsigned int node; // NUMA node its segments and slabs are placed on
+  _Atomic unsigned int nthreads; // threads currently assigned to it
+  segment_t *segments;
+  size_t segment_size; // size of the next segment to map
+  memory_block_t *bins[NUM_BINS];
+  uint64_t binmap;
+  memory_block_t *quick[NUM_BINS]; // deferred blocks, through next_free
+  unsigned int deferred;
+  size_t deferred_bytes;
+  uint64_t decay_deadline; // end of the decay epoch in ms, 0 if none runs
+  remote_queue_t remote;   // blocks freed by other arenas' threads
+  slab_bin_t slab_bins[NUM_SLAB_CLASSES];
+  pthread_mutex_t slab_lock;
+  slab_t *empty_slabs; // wholly free slabs, reusable by any class
+  // usage, for tinymalloc_node_stats
+  size_t segment_bytes;      // under the heap lock
+  size_t slab_bytes;         // under slab_lock
+  _Atomic size_t remote_frees;
+} arena_t;
+
+static arena_t arenas[MAX_ARENAS];
+static unsigned int narenas = 1;
+static int arena_mode = ARENA_PER_THREAD;
+static _Atomic unsigned int next_arena = 0;
+
+/* NUMA */
+// on hosts with more than one NUMA node holding CPUs, the arenas are split
+// evenly between those nodes. each arena asks for its segments and slabs
+// to be placed on its node (MPOL_PREFERRED, so a full node spills over),
+// and threads only use arenas of the node they run on. as memory always
+// goes back to the arena owning it, remote frees end up on their node.
+// node ids are the kernel's, read from sysfs once at startup
+#define MAX_NUMA_NODES 64
+#define MAX_CPUS 1024
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static unsigned int numa_nodes = 1; // 1 + the highest node id with CPUs
+static uint8_t cpu_arena[MAX_CPUS]; // arena of each CPU in per-CPU mode
+static uint8_t node_first[MAX_NUMA_NODES];  // first arena of each node
+static uint8_t node_arenas[MAX_NUMA_NODES]; // how many arenas it has
+
+// the slab region's parts, one per node
+static unsigned int slab_part_shift = SLAB_REGION_SHIFT; // log2 of their size
+static _Atomic size_t slab_region_used[MAX_NUMA_NODES];  // carved of each
+
+/* Thread Cache */
+// every thread keeps up to tcache_depth[class] free slab objects per class,
+// linked through their first word. hits never take a lock: an empty bin is
+// refilled and a full one flushed half a depth at a time, in one locked
+// batch. a thread's cache is flushed back when the thread exits
+#define TCACHE_MAX_DEPTH 1024
+#define TCACHE_MIN_DEPTH 8
+#define TCACHE_DEFAULT_DEPTH 64
+#define TCACHE_CLASS_BYTES (16 * 1024)
+static int conf_tcache_depth = -1; // for all classes, -1 for sized per class
+
+enum { TCACHE_UNINITIALIZED, TCACHE_ACTIVE, TCACHE_DISABLED };
+
+typedef struct tcache_bin {
+  void *head;
+  uint32_t count;
+} tcache_bin_t;
+
+typedef struct tcache {
+  tcache_bin_t bins[NUM_SLAB_CLASSES];
+  int state;
+} tcache_t;
+
+static TM_TLS tcache_t tcache;
+
+// a batch of frees in progress, see free_batch_add
+typedef struct free_batch {
+  arena_t *current;      // the freeing thread's arena
+  pthread_mutex_t *held; // lock of current held, if any
+  arena_t *run_arena;
+  remote_queue_t *run_queue;
+  void *run_first;
+  void *run_last;
+  unsigned int run_count;
+} free_batch_t;
+static _Atomic unsigned int tcache_depth[NUM_SLAB_CLASSES];
+
+// per-thread arena assignment
+static TM_TLS arena_t *thread_arena = NULL;
+static TM_TLS unsigned int thread_contention = 0;
+
+static pthread_key_t thread_key;
+static bool thread_key_created = false;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static _Atomic bool initialized = false; // set once global_init runs
+
+/* Regions */
+// a region (tiny_arena_t) bump-allocates from chunks it gets from
+// tinymalloc, and frees everything at once. a reset keeps the chunks for
+// the next round, so it only rewinds the bump pointer. requests too big for
+// a chunk get a chunk of their own, given back on reset
+#define REGION_INITIAL_CHUNK (64 * 1024)
+#define REGION_MAX_CHUNK (1024 * 1024)
+
+typedef struct region_chunk {
+  struct region_chunk *next;
+  size_t size; // bytes available after the header
+} region_chunk_t;
+
+#define REGION_CHUNK_HEADER                                                    \
+  ((sizeof(region_chunk_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+struct tiny_arena {
+  region_chunk_t *chunks;    // every regular chunk, in bump order
+  region_chunk_t *current;   // the chunk being bumped into
+  region_chunk_t *oversized; // chunks of a single request
+  char *cursor;
+  char *end;
+  size_t chunk_size; // size of the next regular chunk
+};
+
+/* Pools */
+// a pool (tiny_pool_t) hands out fixed-size slots, carved from chunks it
+// gets from tinymalloc and recycled through an intrusive free list, so an
+// alloc or a free is one pop or push under the pool's lock. with magazines
+// enabled each thread also keeps a few free slots of the pool, reached
+// without any lock. magazines live in a handful of thread-local slots,
+// tagged with the generation of their pool: a pool destroyed and another
+// created at the same address never receives the old one's slots
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_MAX_MAGAZINE 1024
+#define POOL_MAGAZINE_SLOTS 8
+
+struct tiny_pool {
+  pthread_mutex_t lock;
+  void *free_list; // free slots, linked through their first word
+  char *cursor;    // slots not handed out yet in the newest chunk
+  char *end;
+  region_chunk_t *chunks;
+  size_t slot_size;
+  size_t align;
+  uint64_t generation;
+  _Atomic unsigned int magazine_depth;
+  struct tiny_pool *next; // list of live pools
+};
+
+typedef struct pool_magazine {
+  struct tiny_pool *pool;
+  uint64_t generation;
+  void *head;
+  uint32_t count;
+} pool_magazine_t;
+
+static TM_TLS pool_magazine_t pool_magazines[POOL_MAGAZINE_SLOTS];
+
+// live pools, so exiting threads can tell which magazines can be given back
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tiny_pool *pools = NULL;
+static uint64_t pool_generation = 0;
+
+/* Heap Profiler */
+// with a sample interval set, about one allocation per interval bytes is
+// recorded along with its backtrace. as in tcmalloc, each thread counts
+// down the bytes it allocates to its next sample, at distances drawn from
+// an exponential distribution of mean the interval, so every byte has the
+// same chance of being sampled and pprof can scale the samples back up.
+// sampled allocations come from the block heap or a mapping of their own,
+// whose TAG_SAMPLED bit sends their free to the profiler. samples_lock
+// covers both hash tables: the live samples by address, and the sites by
+// backtrace, which are kept so the profile counts every site's allocations
+#define PROFILE_DEPTH 32
+#define PROFILE_SITE_BUCKETS 1024   // a power of two
+#define PROFILE_SAMPLE_BUCKETS 4096 // a power of two
+#define PROFILE_RECHECK (1 << 20)   // bytes between checks while it's off
+
+typedef struct profile_site {
+  struct profile_site *next;
+  uint64_t hash;
+  unsigned int depth;
+  void *stack[PROFILE_DEPTH];
+  uint64_t allocs;
+  uint64_t alloc_bytes;
+  uint64_t live;
+  uint64_t live_bytes;
+} profile_site_t;
+
+typedef struct profile_sample {
+  struct profile_sample *next;
+  void *ptr;
+  size_t size;
+  profile_site_t *site;
+} profile_sample_t;
+
+static _Atomic size_t sample_interval;
+static TM_TLS int64_t sample_countdown;
+static TM_TLS bool sample_armed;
+static TM_TLS uint64_t sample_rng;
+
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+static tiny_pool_t *site_pool, *sample_pool;
+static profile_site_t *profile_sites[PROFILE_SITE_BUCKETS];
+static profile_sample_t *profile_samples[PROFILE_SAMPLE_BUCKETS];
+
+/* Debug Builds */
+// built with TINYMALLOC_DEBUG, every allocation is wrapped: a header right
+// before the pointer holds its requested size and a canary telling live
+// from freed, and a tail canary follows the last requested byte. frees
+// check both, and with the state the allocator itself keeps, a heap block
+// whose tag is free or a slab slot whose bit is clear, catch double and
+// invalid frees and overflows. freed memory is poisoned and held in a
+// per-thread quarantine before it can be reused; a write to it is caught
+// when it leaves. live allocations are linked in lists sharded by address
+// for tinymalloc_leak_dump, which runs at exit too
+#ifdef TINYMALLOC_DEBUG
+#define DEBUG_LIVE 0x7e11a11cu
+#define DEBUG_FREED 0xdeadf7eeu
+#define DEBUG_TAIL_BYTES 8
+#define DEBUG_TAIL ((uint64_t)0x5afe5afe5afe5afe)
+#define DEBUG_POISON 0xdf
+#define DEBUG_POISON_MAX 4096 // only the start of bigger objects is poisoned
+#define DEBUG_SHARDS 64       // a power of two
+#define DEBUG_QUARANTINE_SLOTS 1024
+#define DEBUG_QUARANTINE_BYTES (1 << 20) // per thread
+
+typedef struct debug_header {
+  struct debug_header *next; // live allocations of its shard
+  struct debug_header *prev;
+  size_t size;     // as requested
+  uint32_t offset; // from the start of the underlying allocation
+  uint32_t canary; // DEBUG_LIVE or DEBUG_FREED, mixed with the address
+} debug_header_t;
+
+_Static_assert(sizeof(debug_header_t) % ALIGNMENT == 0,
+               "the debug header must keep pointers aligned");
+
+typedef struct debug_shard {
+  _Alignas(64) pthread_mutex_t lock;
+  debug_header_t *live;
+} debug_shard_t;
+
+typedef struct quarantine {
+  size_t bytes;
+  unsigned int head;
+  unsigned int count;
+  void *slots[DEBUG_QUARANTINE_SLOTS];
+} quarantine_t;
+
+static debug_shard_t debug_shards[DEBUG_SHARDS];
+static TM_TLS quarantine_t *quarantine;
+
+static void quarantine_flush();
+#endif
+
+/* Statistics */
+// counters are kept per thread and only written by their thread, with
+// relaxed loads and stores that compile to plain moves, so keeping them
+// costs no lock and no atomic read-modify-write. threads are registered
+// once their cache is, and an exiting thread folds its counts into
+// retired_stats, which also takes what's counted outside of a registered
+// thread. tinymalloc_stats sums them all under stats_lock. byte counts are
+// net, a thread freeing what another allocated makes its own wrap around
+#define STAT_HEAP_CLASS NUM_SLAB_CLASSES        // allocations of the heap
+#define STAT_LARGE_CLASS (NUM_SLAB_CLASSES + 1) // large allocations
+#define NUM_STAT_CLASSES (NUM_SLAB_CLASSES + 2)
+
+_Static_assert(NUM_STAT_CLASSES == TINYMALLOC_STATS_CLASSES,
+               "tinymalloc.h disagrees on the number of classes");
+
+enum {
+  STAT_ALLOCS, // one per class
+  STAT_FREES = STAT_ALLOCS + NUM_STAT_CLASSES,
+  STAT_HEAP_BYTES = STAT_FREES + NUM_STAT_CLASSES, // block sizes
+  STAT_LARGE_BYTES,                                // mapping lengths
+  STAT_MMAP_CALLS,
+  STAT_MUNMAP_CALLS,
+  STAT_CONTENTION,
+  STAT_TCACHE_HITS,
+  STAT_TCACHE_MISSES,
+  NUM_STATS
+};
+
+typedef struct thread_stats {
+  struct thread_stats *next; // registered threads
+  struct thread_stats *prev;
+  bool registered;
+  _Atomic uint64_t counters[NUM_STATS];
+} thread_stats_t;
+
+static TM_TLS thread_stats_t thread_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_stats_t *stats_threads = NULL;
+static _Atomic uint64_t retired_stats[NUM_STATS];
+
+/* stat_add */
+static void stat_add(unsigned int counter, uint64_t n) {
+  if (thread_stats.registered) {
+    _Atomic uint64_t *value = &thread_stats.counters[counter];
+    atomic_store_explicit(
+        value, atomic_load_explicit(value, memory_order_relaxed) + n,
+        memory_order_relaxed);
+  } else {
+    atomic_fetch_add_explicit(&retired_stats[counter], n,
+                              memory_order_relaxed);
+  }
+}
+
+/* stat_sub */
+static void stat_sub(unsigned int counter, uint64_t n) {
+  stat_add(counter, (uint64_t)0 - n);
+}
+
+/* stats_register */
+static void stats_register() {
+  pthread_mutex_lock(&stats_lock);
+  thread_stats.prev = NULL;
+  thread_stats.next = stats_threads;
+  if (stats_threads) {
+    stats_threads->prev = &thread_stats;
+  }
+  stats_threads = &thread_stats;
+  thread_stats.registered = true;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/* stats_unregister */
+// folds an exiting thread's counts into retired_stats
+static void stats_unregister() {
+  if (!thread_stats.registered) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  if (thread_stats.prev) {
+    thread_stats.prev->next = thread_stats.next;
+  } else {
+    stats_threads = thread_stats.next;
+  }
+  if (thread_stats.next) {
+    thread_stats.next->prev = thread_stats.prev;
+  }
+  for (size_t i = 0; i < NUM_STATS; i++) {
+    atomic_fetch_add_explicit(&retired_stats[i],
+                              atomic_load_explicit(&thread_stats.counters[i],
+                                                   memory_order_relaxed),
+                              memory_order_relaxed);
+  }
+  thread_stats.registered = false;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/* os_map */
+// every mapping the allocator makes for itself goes through os_map and
+// os_unmap, which count them
+static void *os_map(size_t length, int prot, int flags) {
+  stat_add(STAT_MMAP_CALLS, 1);
+  return mmap(NULL, length, prot, flags, -1, 0);
+}
+
+/* os_unmap */
+static void os_unmap(void *addr, size_t length) {
+  stat_add(STAT_MUNMAP_CALLS, 1);
+  munmap(addr, length);
+}
+
+/* pagemap_leaf */
+// the leaf of a page number, mapped if create is set and it's missing.
+// racing threads both map one, the loser unmaps its own
+static pagemap_leaf_t *pagemap_leaf(uintptr_t page, bool create) {
+  _Atomic(pagemap_leaf_t *) *slot = &pagemap_root[page >> PAGEMAP_LEAF_BITS];
+  pagemap_leaf_t *leaf = atomic_load_explicit(slot, memory_order_acquire);
+  if (leaf || !create) {
+    return leaf;
+  }
+
+  pagemap_leaf_t *fresh = os_map(sizeof(pagemap_leaf_t), PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS);
+  if (fresh == MAP_FAILED) {
+    return NULL;
+  }
+  if (!atomic_compare_exchange_strong(slot, &leaf, fresh)) {
+    os_unmap(fresh, sizeof(pagemap_leaf_t));
+    return leaf;
+  }
+  return fresh;
+}
+
+/* pagemap_set */
+// marks the pages of [addr, addr + length) as kind. a range is registered
+// before its memory is handed out and cleared before it's unmapped, so a
+// mapping made at the same address by another thread is never cleared by
+// mistake. returns false if a leaf couldn't be mapped or the range is past
+// the addresses the map covers
+static bool pagemap_set(void *addr, size_t length, uint8_t kind) {
+  uintptr_t page = (uintptr_t)addr >> PAGEMAP_SHIFT;
+  uintptr_t end = ((uintptr_t)addr + length - 1) >> PAGEMAP_SHIFT;
+  if (end >> (PAGEMAP_ADDRESS_BITS - PAGEMAP_SHIFT)) {
+    return false;
+  }
+
+  while (page <= end) {
+    pagemap_leaf_t *leaf = pagemap_leaf(page, kind != PAGE_FOREIGN);
+    uintptr_t leaf_end = page | (PAGEMAP_LEAF_PAGES - 1);
+    uintptr_t last = end < leaf_end ? end : leaf_end;
+    if (leaf == NULL && kind != PAGE_FOREIGN) {
+      return false;
+    }
+    for (; leaf && page <= last; page++) {
+      atomic_store_explicit(&leaf->pages[page & (PAGEMAP_LEAF_PAGES - 1)], kind,
+                            memory_order_relaxed);
+    }
+    page = last + 1;
+  }
+  return true;
+}
+
+/* pagemap_get */
+static int pagemap_get(const void *ptr) {
+  uintptr_t page = (uintptr_t)ptr >> PAGEMAP_SHIFT;
+  if (page >> (PAGEMAP_ADDRESS_BITS - PAGEMAP_SHIFT)) {
+    return PAGE_FOREIGN;
+  }
+  pagemap_leaf_t *leaf = pagemap_leaf(page, false);
+  if (leaf == NULL) {
+    return PAGE_FOREIGN;
+  }
+  return atomic_load_explicit(&leaf->pages[page & (PAGEMAP_LEAF_PAGES - 1)],
+                              memory_order_relaxed);
+}
+
+/* log2_floor */
+static size_t log2_floor(size_t x) {
+  return sizeof(unsigned long long) * 8 - 1 -
+         (size_t)__builtin_clzll((unsigned long long)x);
+}
+
+/* size_to_bin */
+// maps an aligned size to the bin whose range contains it
+static size_t size_to_bin(size_t size) {
+  if (size <= SMALL_BIN_MAX) {
+    return size / ALIGNMENT - 1;
+  }
+
+  size_t bin = NUM_SMALL_BINS + log2_floor(size) - log2_floor(SMALL_BIN_MAX);
+  return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+/* block_size */
+static size_t block_size(memory_block_t *block) {
+  return (size_t)(block->tag & TAG_SIZE_MASK);
+}
+
+/* block_tag */
+// reads the tag of an in-use block without holding its arena's lock. the
+// block before it may be freed or taken meanwhile, which changes the
+// PREV_IN_USE flag in the same word, see mark_free
+static uint64_t block_tag(memory_block_t *block) {
+  return __atomic_load_n(&block->tag, __ATOMIC_RELAXED);
+}
+
+/* block_arena */
+static unsigned int block_arena(memory_block_t *block) {
+  return (unsigned int)(block_tag(block) >> TAG_ARENA_SHIFT);
+}
+
+/* block_in_use */
+static bool block_in_use(memory_block_t *block) {
+  return (block->tag & TAG_IN_USE) != 0;
+}
+
+/* make_tag */
+static uint64_t make_tag(size_t size, uint64_t flags, unsigned int arena) {
+  return (uint64_t)size | flags | (uint64_t)arena << TAG_ARENA_SHIFT;
+}
+
+/* next_block */
+// returns the block physically after a block
+static memory_block_t *next_block(memory_block_t *block) {
+  return (memory_block_t *)((char *)block + block_size(block));
+}
+
+/* prev_block */
+// returns the block physically before a block, which must be free
+static memory_block_t *prev_block(memory_block_t *block) {
+  uint64_t footer = ((uint64_t *)block)[-1];
+  return (memory_block_t *)((char *)block - footer);
+}
+
+/* mark_free */
+// writes the footer of a free block and tells the next block about it.
+// the next block may be in use, and its owner reading its tag unlocked,
+// so the flag is changed atomically
+static void mark_free(memory_block_t *block) {
+  block->tag &= ~TAG_IN_USE;
+  *(uint64_t *)((char *)next_block(block) - sizeof(uint64_t)) =
+      block_size(block);
+  __atomic_fetch_and(&next_block(block)->tag, ~TAG_PREV_IN_USE,
+                     __ATOMIC_RELAXED);
+}
+
+/* mark_in_use */
+static void mark_in_use(memory_block_t *block) {
+  block->tag |= TAG_IN_USE;
+  __atomic_fetch_or(&next_block(block)->tag, TAG_PREV_IN_USE,
+                    __ATOMIC_RELAXED);
+}
+
+/* free_links */
+static free_links_t *free_links(memory_block_t *block) {
+  return (free_links_t *)(block + 1);
+}
+
+/* insert_free_block */
+// pushes a free block in front of the list of its bin
+static void insert_free_block(arena_t *arena, memory_block_t *block) {
+  size_t bin = size_to_bin(block_size(block));
+  free_links_t *links = free_links(block);
+
+  links->prev_free = NULL;
+  links->next_free = arena->bins[bin];
+  if (arena->bins[bin]) {
+    free_links(arena->bins[bin])->prev_free = block;
+  }
+  arena->bins[bin] = block;
+  arena->binmap |= 1ULL << bin;
+}
+
+/* remove_from_free_list */
+// unlinks a free block from its bin. the caller holds the arena's lock
+void remove_from_free_list(arena_t *arena, memory_block_t *block) {
+  size_t bin = size_to_bin(block_size(block));
+  free_links_t *links = free_links(block);
+
+  if (links->prev_free) {
+    free_links(links->prev_free)->next_free = links->next_free;
+  } else {
+    arena->bins[bin] = links->next_free;
+  }
+  if (links->next_free) {
+    free_links(links->next_free)->prev_free = links->prev_free;
+  }
+
+  if (arena->bins[bin] == NULL) {
+    arena->binmap &= ~(1ULL << bin);
+  }
+}
+
+/* first_fit */
+// returns the first block of a bin list of at least size bytes whose pages
+// are committed, or else the first purged one, or NULL. small blocks are
+// never purged, so a small bin's head is taken right away
+static memory_block_t *first_fit(memory_block_t *block, size_t size) {
+  memory_block_t *purged = NULL;
+  for (; block; block = free_links(block)->next_free) {
+    if (block_size(block) >= size) {
+      if (!(block->tag & TAG_PURGED)) {
+        return block;
+      }
+      if (purged == NULL) {
+        purged = block;
+      }
+    }
+  }
+  return purged;
+}
+
+/* find_free_block */
+// returns a free block of at least size bytes, or NULL if no bin has one.
+// small bins are exact, so their head always fits. a power-of-two bin can
+// hold blocks smaller than the request, so it is searched first-fit before
+// falling back to the first non-empty bin above it, whose blocks all fit.
+// the caller holds the arena's lock
+memory_block_t *find_free_block(arena_t *arena, size_t size) {
+  size_t bin = size_to_bin(size);
+
+  memory_block_t *block = first_fit(arena->bins[bin], size);
+  if (block) {
+    return block;
+  }
+
+  // 2ULL << 63 wraps to 0, which correctly leaves no candidate above bin 63
+  uint64_t candidates = arena->binmap & ~((2ULL << bin) - 1);
+  if (candidates == 0) {
+    return NULL;
+  }
+
+  return first_fit(arena->bins[__builtin_ctzll(candidates)], size);
+}
+
+/* split_block */
+// shrinks a block to size bytes and turns the tail into a new free block,
+// if the tail is big enough to be one. the block itself is, or is about to
+// be marked, in use
+memory_block_t *split_block(arena_t *arena, memory_block_t *block,
+                            size_t size) {
+  size_t total = block_size(block);
+  if (total < size + MIN_BLOCK) {
+    return block;
+  }
+
+  memory_block_t *new_block = (memory_block_t *)((char *)block + size);
+  new_block->tag = make_tag(total - size,
+                            TAG_PREV_IN_USE |
+                                (block->tag & (TAG_ZEROED | TAG_PURGED)),
+                            block_arena(block));
+  block->tag = (block->tag & ~TAG_SIZE_MASK) | size;
+  mark_free(new_block);
+
+  insert_free_block(arena, new_block);
+  TM_TRACE(SPLIT, block, size, total - size);
+  return block;
+}
+
+/* now_ms */
+// decay needs no precision, so a coarse clock does and is cheaper to read
+static uint64_t now_ms() {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/* purge_block */
+// gives the whole pages of a free block back to the OS, all but the ones
+// holding its tag, links and footer, and returns how many bytes they were.
+// lazy purges use MADV_FREE, whose pages are only reclaimed under memory
+// pressure and cost nothing if they're written again before that
+static size_t purge_block(memory_block_t *block, bool lazy) {
+  uintptr_t start = ((uintptr_t)(free_links(block) + 1) + page_size - 1) &
+                    ~(uintptr_t)(page_size - 1);
+  uintptr_t end = ((uintptr_t)next_block(block) - sizeof(uint64_t)) &
+                  ~(uintptr_t)(page_size - 1);
+  block->tag |= TAG_PURGED;
+  if (end <= start) {
+    return 0;
+  }
+
+  bool done = false;
+#ifdef MADV_FREE
+  // kernels before 4.5 don't know MADV_FREE and fail it
+  done = lazy && madvise((void *)start, end - start, MADV_FREE) == 0;
+#endif
+  if (!done && madvise((void *)start, end - start, MADV_DONTNEED) != 0) {
+    return 0;
+  }
+  TM_TRACE(PURGE, block, end - start, lazy);
+  return end - start;
+}
+
+/* arena_purge */
+// purges the free runs of an arena big enough for it. lazy purges skip the
+// runs purged already. zeroed runs never had their pages touched, so
+// they're skipped too. the caller holds the arena's lock
+static size_t arena_purge(arena_t *arena, bool lazy) {
+  uint64_t skip = lazy ? TAG_ZEROED | TAG_PURGED : TAG_ZEROED;
+  size_t purged = 0;
+
+  arena->decay_deadline = 0;
+  for (size_t bin = size_to_bin(PURGE_MIN_RUN); bin < NUM_BINS; bin++) {
+    for (memory_block_t *block = arena->bins[bin]; block;
+         block = free_links(block)->next_free) {
+      if (block_size(block) >= PURGE_MIN_RUN && !(block->tag & skip)) {
+        purged += purge_block(block, lazy);
+      }
+    }
+  }
+  return purged;
+}
+
+/* arena_decay */
+// starts a decay epoch when a dirty run was just freed and none runs yet,
+// and purges the arena once the epoch is over. the caller holds the lock
+static void arena_decay(arena_t *arena, bool dirtied) {
+  if (arena->decay_deadline == 0 && !dirtied) {
+    return;
+  }
+
+  uint64_t now = now_ms();
+  if (arena->decay_deadline == 0) {
+    arena->decay_deadline =
+        now + atomic_load_explicit(&decay_ms, memory_order_relaxed);
+  }
+  if (now >= arena->decay_deadline) {
+    arena_purge(arena, true);
+  }
+}
+
+/* coalesce_block */
+// merges a freshly freed block with its free physical neighbours and puts
+// the result back into the free lists. the caller holds the arena's lock
+static void coalesce_block(arena_t *arena, memory_block_t *block) {
+  // coalesce with next block. sizes stay clear of the flags, so adding
+  // them keeps the flags of the surviving tag
+  memory_block_t *next = next_block(block);
+  if (!block_in_use(next)) {
+    TM_TRACE(COALESCE, block, block_size(next), next);
+    remove_from_free_list(arena, next);
+    block->tag += block_size(next);
+  }
+
+  // coalesce with previous block
+  if (!(block->tag & TAG_PREV_IN_USE)) {
+    memory_block_t *prev = prev_block(block);
+    TM_TRACE(COALESCE, prev, block_size(block), block);
+    remove_from_free_list(arena, prev);
+    prev->tag += block_size(block);
+    block = prev;
+  }
+
+  // a freed payload is dirty, and so is anything merged with it
+  block->tag &= ~(TAG_ZEROED | TAG_PURGED);
+  mark_free(block);
+  insert_free_block(arena, block);
+  if (block_size(block) >= PURGE_MIN_RUN) {
+    arena_decay(arena, true);
+  }
+}
+
+/* coalesce */
+// the consolidation pass: every deferred block of the arena is merged and
+// goes to the free lists. a deferred neighbour looks in use until its own
+// turn comes, and merges then. the caller holds the arena's lock
+void coalesce(arena_t *arena) {
+  for (size_t bin = 0; arena->deferred > 0 && bin < NUM_BINS; bin++) {
+    while (arena->quick[bin]) {
+      memory_block_t *block = arena->quick[bin];
+      arena->quick[bin] = free_links(block)->next_free;
+      arena->deferred--;
+      coalesce_block(arena, block);
+    }
+  }
+  arena->deferred_bytes = 0;
+}
+
+/* defer_block */
+// puts a freed block on its quick list rather than merging it, if deferred
+// coalescing is on and the block is small enough. returns false otherwise
+static bool defer_block(arena_t *arena, memory_block_t *block) {
+  unsigned int limit =
+      atomic_load_explicit(&deferred_coalescing, memory_order_relaxed);
+  if (limit == 0 || block_size(block) >= PURGE_MIN_RUN) {
+    return false;
+  }
+  if (arena->deferred >= limit) {
+    coalesce(arena);
+  }
+
+  size_t bin = size_to_bin(block_size(block));
+  block->tag &= ~(TAG_ZEROED | TAG_PURGED); // its payload is dirty
+  free_links(block)->next_free = arena->quick[bin];
+  arena->quick[bin] = block;
+  arena->deferred++;
+  arena->deferred_bytes += block_size(block);
+  return true;
+}
+
+/* quick_take */
+// takes a deferred block for size bytes off the quick list of the bin for
+// size, looking at its first QUICK_SCAN entries. only blocks that fit
+// without a tail to split off are taken: cutting bigger ones leaves the
+// tails in front of the free lists, which then take longer to search.
+// NULL if none fits
+static memory_block_t *quick_take(arena_t *arena, size_t size) {
+  memory_block_t **link = &arena->quick[size_to_bin(size)];
+  for (int i = 0; *link && i < QUICK_SCAN; i++) {
+    memory_block_t *block = *link;
+    if (block_size(block) >= size && block_size(block) < size + MIN_BLOCK) {
+      *link = free_links(block)->next_free;
+      arena->deferred--;
+      arena->deferred_bytes -= block_size(block);
+      return block;
+    }
+    link = &free_links(block)->next_free;
+  }
+  return NULL;
+}
+
+/* size_to_slab_class */
+// maps a request of at most SLAB_MAX bytes to the smallest class fitting it
+static size_t size_to_slab_class(size_t size) {
+  if (size <= 128) {
+    return size <= SLAB_MIN_OBJECT ? 0 : (size - 1) / 16;
+  }
+
+  // four classes per power-of-two group: (128, 256] is classes 8..11, ...
+  size_t group = log2_floor(size - 1);
+  size_t step = ((size_t)1 << group) / 4;
+  return 8 + (group - 7) * 4 + ((size - 1) - ((size_t)1 << group)) / step;
+}
+
+/* is_slab_ptr */
+// the whole reservation is ours, so there's no need to look at how much of
+// it has been carved
+static bool is_slab_ptr(const void *ptr) {
+  char *region = atomic_load_explicit(&slab_region, memory_order_relaxed);
+  return region && (uintptr_t)ptr - (uintptr_t)region < SLAB_REGION_SIZE;
+}
+
+/* ptr_to_slab */
+static slab_t *ptr_to_slab(void *ptr) {
+  return (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+/* is_owned */
+// tells whether ptr lies in a slab, a heap segment or a large mapping
+static bool is_owned(const void *ptr) {
+  if (is_slab_ptr(ptr)) {
+    // the part of the region not carved yet can't even be read
+    uintptr_t offset = (uintptr_t)ptr - (uintptr_t)atomic_load(&slab_region);
+    return (offset & (((uintptr_t)1 << slab_part_shift) - 1)) <
+           atomic_load(&slab_region_used[offset >> slab_part_shift]);
+  }
+  return pagemap_get(ptr) != PAGE_FOREIGN;
+}
+
+/* slab_unlink */
+static void slab_unlink(slab_t **list, slab_t *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+/* slab_push */
+static void slab_push(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+/* reserve_slab_region */
+// reserves the address range slabs are carved from. it is mapped without
+// access rights, slabs get theirs one at a time when they're carved.
+// if it fails, small requests simply take the block path
+static void reserve_slab_region() {
+  while ((1u << (SLAB_REGION_SHIFT - slab_part_shift)) < numa_nodes) {
+    slab_part_shift--;
+  }
+  char *region = os_map(SLAB_REGION_SIZE + SLAB_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS);
+  if (region == MAP_FAILED) {
+    return;
+  }
+
+  // align the start, so that masking a pointer finds its slab header
+  atomic_store(&slab_region, (char *)(((uintptr_t)region + SLAB_SIZE - 1) &
+                                      ~(uintptr_t)(SLAB_SIZE - 1)));
+}
+
+/* carve_slab */
+// takes the next unused slab of a node's part of the region, shared by the
+// arenas of the node
+static slab_t *carve_slab(unsigned int node) {
+  char *region = atomic_load(&slab_region);
+  if (region == NULL) {
+    return NULL;
+  }
+
+  _Atomic size_t *used = &slab_region_used[node];
+  size_t offset = atomic_load(used);
+  do {
+    if (offset + SLAB_SIZE > (size_t)1 << slab_part_shift) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak(used, &offset, offset + SLAB_SIZE));
+
+  slab_t *slab =
+      (slab_t *)(region + ((size_t)node << slab_part_shift) + offset);
+  if (mprotect(slab, SLAB_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+  return slab;
+}
+
+static void numa_bind(void *addr, size_t length, unsigned int node);
+
+/* slab_create */
+// gets a slab for a class, reusing an empty one of the arena if possible.
+// the caller holds the class lock
+static slab_t *slab_create(arena_t *arena, size_t class_idx) {
+  pthread_mutex_lock(&arena->slab_lock);
+  slab_t *slab = arena->empty_slabs;
+  if (slab) {
+    slab_unlink(&arena->empty_slabs, slab);
+  } else if ((slab = carve_slab(arena->node)) != NULL) {
+    numa_bind(slab, SLAB_SIZE, arena->node);
+    arena->slab_bytes += SLAB_SIZE;
+  }
+  pthread_mutex_unlock(&arena->slab_lock);
+  if (slab == NULL) {
+    return NULL;
+  }
+
+  uint32_t object_size = slab_class_size[class_idx];
+  uint32_t nslots = (uint32_t)((SLAB_SIZE - SLAB_DATA_OFFSET) / object_size);
+
+  slab->arena = arena;
+  slab->class_idx = (uint32_t)class_idx;
+  slab->object_size = object_size;
+  slab->nslots = nslots;
+  slab->nfree = nslots;
+  slab->hint = 0;
+  slab->purged = false;
+
+  // the bits past the last slot are marked in use, so they're never picked
+  memset(slab->bitmap, 0, sizeof(slab->bitmap));
+  for (uint32_t slot = nslots; slot < SLAB_BITMAP_WORDS * 64; slot++) {
+    slab->bitmap[slot / 64] |= 1ULL << (slot % 64);
+  }
+
+  slab_push(&arena->slab_bins[class_idx].partial, slab);
+  return slab;
+}
+
+/* slab_alloc */
+// hands out the lowest free slot of the first partial slab of a class.
+// the caller holds the class lock
+static void *slab_alloc(arena_t *arena, size_t class_idx) {
+  slab_t *slab = arena->slab_bins[class_idx].partial;
+  if (slab == NULL && (slab = slab_create(arena, class_idx)) == NULL) {
+    return NULL;
+  }
+
+  // a partial slab always has a free slot at or after hint
+  uint32_t word = slab->hint;
+  while (slab->bitmap[word] == ~0ULL) {
+    word++;
+  }
+
+  uint32_t bit = (uint32_t)__builtin_ctzll(~slab->bitmap[word]);
+  slab->bitmap[word] |= 1ULL << bit;
+  slab->hint = word;
+
+  if (--slab->nfree == 0) {
+    slab_unlink(&arena->slab_bins[class_idx].partial, slab);
+  }
+
+  return (char *)slab + SLAB_DATA_OFFSET +
+         (size_t)(word * 64 + bit) * slab->object_size;
+}
+
+/* slab_free */
+// clears the slot's bit. a slab that becomes empty is given back to the
+// arena's empty list, unless it's the last partial slab of its class.
+// the caller holds the lock of the slab's class in its arena
+static void slab_free(void *ptr) {
+  slab_t *slab = ptr_to_slab(ptr);
+  arena_t *arena = slab->arena;
+  size_t slot =
+      (size_t)((char *)ptr - ((char *)slab + SLAB_DATA_OFFSET)) /
+      slab->object_size;
+  uint32_t word = (uint32_t)(slot / 64);
+
+  slab->bitmap[word] &= ~(1ULL << (slot % 64));
+  if (word < slab->hint) {
+    slab->hint = word;
+  }
+
+  slab_bin_t *bin = &arena->slab_bins[slab->class_idx];
+  if (slab->nfree++ == 0) {
+    // it was full, so it isn't on the partial list
+    slab_push(&bin->partial, slab);
+  } else if (slab->nfree == slab->nslots &&
+             (slab->prev || slab->next)) {
+    slab_unlink(&bin->partial, slab);
+    pthread_mutex_lock(&arena->slab_lock);
+    slab_push(&arena->empty_slabs, slab);
+    pthread_mutex_unlock(&arena->slab_lock);
+  }
+}
+
+/* lock_counted */
+// a failed trylock on a lock of the thread's own arena counts as
+// contention, which eventually makes the thread look for a quieter arena
+static void lock_counted(arena_t *arena, pthread_mutex_t *lock) {
+  if (pthread_mutex_trylock(lock) != 0) {
+    if (arena == thread_arena) {
+      thread_contention++;
+    }
+    stat_add(STAT_CONTENTION, 1);
+    pthread_mutex_lock(lock);
+  }
+}
+
+/* arena_lock */
+static void arena_lock(arena_t *arena) { lock_counted(arena, &arena->lock); }
+
+/* arena_unlock */
+static void arena_unlock(arena_t *arena) { pthread_mutex_unlock(&arena->lock); }
+
+/* arena_rebalance */
+// moves the calling thread to the least loaded arena of its node, if that
+// is at least two threads lighter than its current one
+static void arena_rebalance() {
+  arena_t *current = thread_arena;
+  arena_t *best = current;
+  unsigned int best_load = atomic_load(&current->nthreads);
+
+  thread_contention = 0;
+  for (unsigned int i = 0; i < narenas; i++) {
+    unsigned int load = atomic_load(&arenas[i].nthreads);
+    if (arenas[i].node == current->node && load + 1 < best_load) {
+      best = &arenas[i];
+      best_load = load;
+    }
+  }
+
+  if (best != current) {
+    atomic_fetch_sub(&current->nthreads, 1);
+    atomic_fetch_add(&best->nthreads, 1);
+    thread_arena = best;
+  }
+}
+
+/* current_cpu */
+// returns the CPU the caller runs on, or -1 if it can't be known
+static int current_cpu() {
+#ifdef TINYMALLOC_HAVE_RSEQ
+  if (__rseq_size > 0) {
+    struct rseq *rs =
+        (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+    int cpu = (int)*(volatile uint32_t *)&rs->cpu_id;
+    if (cpu >= 0) {
+      return cpu;
+    }
+  }
+#endif
+#ifdef __linux__
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
+/* parse_list */
+// sets marks[i] to value for every i of a sysfs list like "0-3,8,10-11"
+// below n, and returns how many were listed
+static size_t parse_list(const char *list, uint8_t *marks, size_t n,
+                         uint8_t value) {
+  size_t listed = 0;
+  while (*list >= '0' && *list <= '9') {
+    char *end;
+    unsigned long first = strtoul(list, &end, 10);
+    unsigned long last = first;
+    if (*end == '-') {
+      last = strtoul(end + 1, &end, 10);
+    }
+    for (unsigned long i = first; i <= last && i < n; i++) {
+      marks[i] = value;
+      listed++;
+    }
+    list = *end == ',' ? end + 1 : end;
+  }
+  return listed;
+}
+
+/* read_node_file */
+// reads a file of /sys/devices/system/node, of a node's directory unless
+// node is negative. the path is put together by hand: snprintf may
+// allocate, and this runs before the allocator is set up
+static bool read_node_file(int node, const char *name, char *buf,
+                           size_t size) {
+  char path[96] = "/sys/devices/system/node/";
+  size_t len = strlen(path);
+  if (node >= 0) {
+    char digits[4];
+    size_t n = 0;
+    memcpy(path + len, "node", 4);
+    len += 4;
+    do {
+      digits[n++] = (char)('0' + node % 10);
+      node /= 10;
+    } while (node > 0 && n < sizeof(digits));
+    while (n > 0) {
+      path[len++] = digits[--n];
+    }
+    path[len++] = '/';
+  }
+  memcpy(path + len, name, strlen(name) + 1);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t got = read(fd, buf, size - 1);
+  close(fd);
+  if (got <= 0) {
+    return false;
+  }
+  buf[got] = '\0';
+  return true;
+}
+
+/* numa_setup */
+// finds the nodes holding CPUs and gives each an even share of the arenas.
+// CPUs outside of any node keep the arena their number picks
+static void numa_setup() {
+  for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    cpu_arena[cpu] = (uint8_t)(cpu % narenas);
+  }
+
+#ifdef __linux__
+  static uint8_t cpu_node[MAX_CPUS];
+  uint8_t online[MAX_NUMA_NODES] = {0};
+  char buf[4096];
+  if (!read_node_file(-1, "online", buf, sizeof(buf)) ||
+      parse_list(buf, online, MAX_NUMA_NODES, 1) < 2) {
+    return;
+  }
+
+  unsigned int nodes[MAX_NUMA_NODES];
+  unsigned int count = 0;
+  memset(cpu_node, 0xff, sizeof(cpu_node));
+  for (unsigned int node = 0; node < MAX_NUMA_NODES; node++) {
+    if (online[node] && read_node_file((int)node, "cpulist", buf, sizeof(buf)) &&
+        parse_list(buf, cpu_node, MAX_CPUS, (uint8_t)node) > 0) {
+      nodes[count++] = node;
+    }
+  }
+  if (count < 2 || count > narenas) {
+    return;
+  }
+
+  unsigned int share = narenas / count;
+  for (unsigned int i = 0; i < count; i++) {
+    unsigned int node = nodes[i];
+    node_first[node] = (uint8_t)(i * share);
+    node_arenas[node] = (uint8_t)(i + 1 < count ? share : narenas - i * share);
+    for (unsigned int j = 0; j < node_arenas[node]; j++) {
+      arenas[node_first[node] + j].node = node;
+    }
+  }
+  numa_nodes = nodes[count - 1] + 1;
+
+  // the CPUs of a node are spread over its arenas
+  unsigned int rank[MAX_NUMA_NODES] = {0};
+  for (size_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+    unsigned int node = cpu_node[cpu];
+    if (node < MAX_NUMA_NODES) {
+      cpu_arena[cpu] =
+          (uint8_t)(node_first[node] + rank[node]++ % node_arenas[node]);
+    }
+  }
+#endif
+}
+
+/* numa_bind */
+// asks for the pages of a new mapping to come from a node
+static void numa_bind(void *addr, size_t length, unsigned int node) {
+#ifdef SYS_mbind
+  if (numa_nodes > 1) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, addr, length, MPOL_PREFERRED, &mask,
+            sizeof(mask) * 8 + 1, 0);
+  }
+#else
+  (void)addr;
+  (void)length;
+  (void)node;
+#endif
+}
+
+/* object_lock */
+// returns the lock covering an object of an arena: its slab class's, or
+// the heap's for blocks
+static pthread_mutex_t *object_lock(arena_t *arena, void *ptr) {
+  return is_slab_ptr(ptr) ? &arena->slab_bins[ptr_to_slab(ptr)->class_idx].lock
+                          : &arena->lock;
+}
+
+/* object_queue */
+// returns the remote-free queue an object goes on, the one drained under
+// the lock covering it
+static remote_queue_t *object_queue(arena_t *arena, void *ptr) {
+  return is_slab_ptr(ptr)
+             ? &arena->slab_bins[ptr_to_slab(ptr)->class_idx].remote
+             : &arena->remote;
+}
+
+/* free_locked */
+// gives an object back to the arena holding it. the caller holds the lock
+// covering the object
+static void free_locked(arena_t *arena, void *ptr) {
+  if (is_slab_ptr(ptr)) {
+    slab_free(ptr);
+    return;
+  }
+
+  memory_block_t *block = ((memory_block_t *)ptr) - 1;
+  block->tag &= ~TAG_SAMPLED;
+  if (!defer_block(arena, block)) {
+    coalesce_block(arena, block);
+  }
+}
+
+/* arena_drain_remote */
+// frees everything other threads queued on one of the arena's queues. the
+// queue is taken whole, so its consumer never races with the producers'
+// pushes. the caller holds the lock the queue is drained under
+static void arena_drain_remote(arena_t *arena, remote_queue_t *queue) {
+  if (atomic_load_explicit(&queue->head, memory_order_relaxed) == NULL) {
+    return;
+  }
+
+  void *ptr =
+      atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+  unsigned int count =
+      atomic_exchange_explicit(&queue->count, 0, memory_order_relaxed);
+  TM_TRACE(REMOTE_DRAIN, ptr, count, arena->index);
+  atomic_fetch_add_explicit(&arena->remote_frees, count,
+                            memory_order_relaxed);
+  while (ptr) {
+    void *next = *(void **)ptr;
+    free_locked(arena, ptr);
+    ptr = next;
+  }
+}
+
+/* remote_free */
+// pushes a chain of objects, linked through their first word and all going
+// on the same queue, onto that remote-free queue of the arena owning them
+static void remote_free(arena_t *arena, void *first, void *last,
+                        unsigned int count) {
+  remote_queue_t *queue = object_queue(arena, first);
+  void *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  do {
+    *(void **)last = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+      &queue->head, &head, first, memory_order_release,
+      memory_order_relaxed));
+  TM_TRACE(REMOTE_FREE, first, count, arena->index);
+
+  // nobody may be allocating from the owner to drain its queue, so past a
+  // threshold the freeing thread drains it if the lock happens to be free
+  unsigned int queued =
+      atomic_fetch_add_explicit(&queue->count, count, memory_order_relaxed) +
+      count;
+  pthread_mutex_t *lock = object_lock(arena, first);
+  if (queued >= REMOTE_DRAIN_THRESHOLD && pthread_mutex_trylock(lock) == 0) {
+    arena_drain_remote(arena, queue);
+    pthread_mutex_unlock(lock);
+  }
+}
+
+/* free_batch_add */
+// frees one object of a batch. objects of the current arena are freed
+// under the lock covering them, which is kept until an object needs
+// another one, and each run of objects going on the same remote-free
+// queue of another arena is pushed in one go
+static void free_batch_add(free_batch_t *batch, arena_t *arena, void *ptr) {
+  if (arena == batch->current) {
+    pthread_mutex_t *lock = object_lock(arena, ptr);
+    if (lock != batch->held) {
+      if (batch->held) {
+        pthread_mutex_unlock(batch->held);
+      }
+      lock_counted(arena, lock);
+      batch->held = lock;
+    }
+    free_locked(arena, ptr);
+    return;
+  }
+
+  remote_queue_t *queue = object_queue(arena, ptr);
+  if (queue != batch->run_queue) {
+    if (batch->run_queue) {
+      remote_free(batch->run_arena, batch->run_first, batch->run_last,
+                  batch->run_count);
+    }
+    batch->run_arena = arena;
+    batch->run_queue = queue;
+    batch->run_first = ptr;
+    batch->run_count = 0;
+  } else {
+    *(void **)batch->run_last = ptr;
+  }
+  batch->run_last = ptr;
+  batch->run_count++;
+}
+
+/* free_batch_finish */
+static void free_batch_finish(free_batch_t *batch) {
+  if (batch->run_queue) {
+    remote_free(batch->run_arena, batch->run_first, batch->run_last,
+                batch->run_count);
+  }
+  if (batch->held) {
+    pthread_mutex_unlock(batch->held);
+  }
+}
+
+/* tcache_flush */
+// gives the n most recently cached objects of a bin back to their slabs
+static void tcache_flush(tcache_bin_t *bin, uint32_t n, arena_t *current) {
+  TM_TRACE(TCACHE_FLUSH, bin->head, n, current->index);
+
+  free_batch_t batch = {.current = current};
+  while (n-- > 0 && bin->head) {
+    void *ptr = bin->head;
+    bin->head = *(void **)ptr;
+    bin->count--;
+    free_batch_add(&batch, ptr_to_slab(ptr)->arena, ptr);
+  }
+  free_batch_finish(&batch);
+}
+
+static arena_t *choose_arena();
+static void pool_thread_teardown();
+
+/* thread_teardown */
+// pthread key destructor, run when a thread that used the allocator exits
+static void thread_teardown(void *arg) {
+  tcache_t *cache = arg;
+
+#ifdef TINYMALLOC_DEBUG
+  quarantine_flush();
+#endif
+  arena_t *current = choose_arena();
+
+  cache->state = TCACHE_DISABLED;
+  for (size_t i = 0; i < NUM_SLAB_CLASSES; i++) {
+    tcache_flush(&cache->bins[i], cache->bins[i].count, current);
+  }
+
+  pool_thread_teardown();
+  if (thread_arena) {
+    atomic_fetch_sub(&thread_arena->nthreads, 1);
+  }
+  stats_unregister();
+}
+
+/* arena_init_locks */
+static void arena_init_locks(arena_t *arena) {
+  pthread_mutex_init(&arena->lock, NULL);
+  for (size_t c = 0; c < NUM_SLAB_CLASSES; c++) {
+    pthread_mutex_init(&arena->slab_bins[c].lock, NULL);
+  }
+  pthread_mutex_init(&arena->slab_lock, NULL);
+}
+
+/* prefork */
+// fork only copies the calling thread, so no lock of the allocator may be
+// held by another thread at that moment: all of them are taken around it,
+// in the order they nest in
+static void prefork() {
+  pthread_mutex_lock(&pools_lock);
+  for (tiny_pool_t *pool = pools; pool; pool = pool->next) {
+    pthread_mutex_lock(&pool->lock);
+  }
+  for (unsigned int i = 0; i < narenas; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    for (size_t c = 0; c < NUM_SLAB_CLASSES; c++) {
+      pthread_mutex_lock(&arenas[i].slab_bins[c].lock);
+    }
+    pthread_mutex_lock(&arenas[i].slab_lock);
+  }
+  pthread_mutex_lock(&stats_lock);
+  pthread_mutex_lock(&samples_lock);
+#ifdef TINYMALLOC_DEBUG
+  for (size_t i = 0; i < DEBUG_SHARDS; i++) {
+    pthread_mutex_lock(&debug_shards[i].lock);
+  }
+#endif
+}
+
+/* postfork_parent */
+static void postfork_parent() {
+#ifdef TINYMALLOC_DEBUG
+  for (size_t i = DEBUG_SHARDS; i-- > 0;) {
+    pthread_mutex_unlock(&debug_shards[i].lock);
+  }
+#endif
+  pthread_mutex_unlock(&samples_lock);
+  pthread_mutex_unlock(&stats_lock);
+  for (unsigned int i = narenas; i-- > 0;) {
+    pthread_mutex_unlock(&arenas[i].slab_lock);
+    for (size_t c = NUM_SLAB_CLASSES; c-- > 0;) {
+      pthread_mutex_unlock(&arenas[i].slab_bins[c].lock);
+    }
+    pthread_mutex_unlock(&arenas[i].lock);
+  }
+  for (tiny_pool_t *pool = pools; pool; pool = pool->next) {
+    pthread_mutex_unlock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/* postfork_child */
+// the child is single-threaded, its locks start over
+static void postfork_child() {
+  for (unsigned int i = 0; i < narenas; i++) {
+    arena_init_locks(&arenas[i]);
+  }
+  for (tiny_pool_t *pool = pools; pool; pool = pool->next) {
+    pthread_mutex_init(&pool->lock, NULL);
+  }
+  pthread_mutex_init(&pools_lock, NULL);
+  pthread_mutex_init(&stats_lock, NULL);
+  pthread_mutex_init(&samples_lock, NULL);
+#ifdef TINYMALLOC_DEBUG
+  for (size_t i = 0; i < DEBUG_SHARDS; i++) {
+    pthread_mutex_init(&debug_shards[i].lock, NULL);
+  }
+#endif
+}
+
+/* register_fork_handlers */
+// pthread_atfork may allocate, so with GNU C the handlers are registered
+// when the library is loaded rather than by global_init, which runs in the
+// middle of the first allocation
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void register_fork_handlers() {
+  pthread_atfork(prefork, postfork_parent, postfork_child);
+}
+
+/* Configuration */
+// TINYMALLOC_CONF and tinymalloc_set_conf take comma-separated key:value
+// pairs, as in "arenas:8,decay_ms:0,huge_pages:thp". sizes may end in k, m
+// or g. the environment is read by global_init, over what the program set
+// before, and neither getenv nor the parsing below allocate. the arena
+// count and the segment sizes are only read by global_init, the other
+// options can be changed at any time
+//
+//   segment_initial      size of an arena's first heap segment
+//   segment_max          size the segments stop doubling at
+//   large_threshold      smallest request given a mapping of its own
+//   arenas               number of arenas, at most MAX_ARENAS
+//   tcache_depth         thread cache depth of every size class
+//   decay_ms             delay before freed memory is given back to the OS
+//   deferred_coalescing  blocks an arena defers merging, 0 for none
+//   huge_pages           off, thp or hugetlb
+//   sample_interval      mean bytes between heap profile samples, 0 for none
+
+/* conf_is */
+static bool conf_is(const char *key, size_t len, const char *name) {
+  return strlen(name) == len && memcmp(key, name, len) == 0;
+}
+
+/* conf_number */
+// parses a decimal count, with a k, m or g suffix for sizes
+static bool conf_number(const char *value, size_t len, size_t *number) {
+  size_t n = 0, i = 0;
+  for (; i < len && value[i] >= '0' && value[i] <= '9'; i++) {
+    if (n > (SIZE_MAX - 9) / 10) {
+      return false;
+    }
+    n = n * 10 + (size_t)(value[i] - '0');
+  }
+  if (i == 0 || len - i > 1) {
+    return false;
+  }
+
+  if (i < len) {
+    int shift;
+    switch (value[i]) {
+    case 'k':
+    case 'K':
+      shift = 10;
+      break;
+    case 'm':
+    case 'M':
+      shift = 20;
+      break;
+    case 'g':
+    case 'G':
+      shift = 30;
+      break;
+    default:
+      return false;
+    }
+    if (n > SIZE_MAX >> shift) {
+      return false;
+    }
+    n <<= shift;
+  }
+  *number = n;
+  return true;
+}
+
+/* conf_option */
+// applies one pair. returns 0, EINVAL for a bad key or value, or EBUSY for
+// an option read at init once the allocator is set up
+static int conf_option(const char *key, size_t key_len, const char *value,
+                       size_t value_len, bool started) {
+  if (conf_is(key, key_len, "huge_pages")) {
+    int mode = conf_is(value, value_len, "off")       ? TINYMALLOC_HUGE_NONE
+               : conf_is(value, value_len, "thp")     ? TINYMALLOC_HUGE_THP
+               : conf_is(value, value_len, "hugetlb") ? TINYMALLOC_HUGE_HUGETLB
+                                                      : -1;
+    return tinymalloc_set_huge_pages(mode) == 0 ? 0 : EINVAL;
+  }
+
+  size_t n;
+  if (!conf_number(value, value_len, &n)) {
+    return EINVAL;
+  }
+
+  if (conf_is(key, key_len, "segment_initial") ||
+      conf_is(key, key_len, "segment_max")) {
+    if (started) {
+      return EBUSY;
+    }
+    if (n < SEGMENT_MIN_SIZE || n > TAG_SIZE_MASK / 2) {
+      return EINVAL;
+    }
+    if (conf_is(key, key_len, "segment_max")) {
+      segment_max_size = n;
+    } else {
+      segment_initial_size = n;
+    }
+    return 0;
+  }
+  if (conf_is(key, key_len, "arenas")) {
+    if (started) {
+      return EBUSY;
+    }
+    if (n == 0 || n > MAX_ARENAS) {
+      return EINVAL;
+    }
+    conf_arenas = (unsigned int)n;
+    return 0;
+  }
+  if (conf_is(key, key_len, "tcache_depth")) {
+    if (n > TCACHE_MAX_DEPTH) {
+      return EINVAL;
+    }
+    conf_tcache_depth = (int)n;
+    for (size_t i = 0; started && i < NUM_SLAB_CLASSES; i++) {
+      atomic_store(&tcache_depth[i], (unsigned int)n);
+    }
+    return 0;
+  }
+  if (conf_is(key, key_len, "large_threshold")) {
+    return tinymalloc_set_large_threshold(n) == 0 ? 0 : EINVAL;
+  }
+  if (conf_is(key, key_len, "decay_ms")) {
+    if (n > UINT_MAX) {
+      return EINVAL;
+    }
+    tinymalloc_set_decay((unsigned int)n);
+    return 0;
+  }
+  if (conf_is(key, key_len, "deferred_coalescing")) {
+    if (n > UINT_MAX) {
+      return EINVAL;
+    }
+    tinymalloc_set_deferred_coalescing((unsigned int)n);
+    return 0;
+  }
+  if (conf_is(key, key_len, "sample_interval")) {
+    tinymalloc_set_sample_interval(n);
+    return 0;
+  }
+  return EINVAL;
+}
+
+/* conf_parse */
+// applies every pair of a configuration, the bad ones being reported on
+// stderr if report is set. returns 0 or the error of the last bad pair
+static int conf_parse(const char *conf, bool started, bool report) {
+  int err = 0;
+  while (*conf) {
+    const char *comma = strchr(conf, ',');
+    size_t len = comma ? (size_t)(comma - conf) : strlen(conf);
+    const char *colon = memchr(conf, ':', len);
+    if (len > 0) {
+      int pair_err =
+          colon ? conf_option(conf, (size_t)(colon - conf), colon + 1,
+                              len - (size_t)(colon - conf) - 1, started)
+                : EINVAL;
+      // written piece by piece, as snprintf may allocate and this runs in
+      // the middle of the first allocation
+      if (pair_err && report) {
+        const char *prefix = "tinymalloc: ignoring TINYMALLOC_CONF option \"";
+        write_all(STDERR_FILENO, prefix, strlen(prefix));
+        write_all(STDERR_FILENO, conf, len < 64 ? len : 64);
+        write_all(STDERR_FILENO, "\"\n", 2);
+      }
+      err = pair_err ? pair_err : err;
+    }
+    conf += comma ? len + 1 : len;
+  }
+  return err;
+}
+
+/* tinymalloc_set_conf */
+// the arenas are set up by the first allocation, which is what started
+// tells
+int tinymalloc_set_conf(const char *conf) {
+  int err = conf ? conf_parse(conf, atomic_load(&initialized), false) : EINVAL;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* global_init */
+// reads the configuration, then sets up the arenas and the default thread
+// cache depths, which hold about TCACHE_CLASS_BYTES per class within
+// bounds
+static void global_init() {
+  atomic_store(&initialized, true);
+  const char *conf = getenv("TINYMALLOC_CONF");
+  if (conf) {
+    conf_parse(conf, false, true);
+  }
+
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1) {
+    ncpus = 1;
+  }
+  narenas = ncpus * ARENAS_PER_CPU < MAX_ARENAS
+                ? (unsigned int)ncpus * ARENAS_PER_CPU
+                : MAX_ARENAS;
+  if (conf_arenas) {
+    narenas = conf_arenas;
+  }
+
+  for (unsigned int i = 0; i < narenas; i++) {
+    arena_init_locks(&arenas[i]);
+    arenas[i].index = i;
+  }
+  numa_setup();
+
+  for (size_t i = 0; i < NUM_SLAB_CLASSES; i++) {
+    unsigned int depth = TCACHE_CLASS_BYTES / slab_class_size[i];
+    if (depth > TCACHE_DEFAULT_DEPTH) {
+      depth = TCACHE_DEFAULT_DEPTH;
+    }
+    if (depth < TCACHE_MIN_DEPTH) {
+      depth = TCACHE_MIN_DEPTH;
+    }
+    if (conf_tcache_depth >= 0) {
+      depth = (unsigned int)conf_tcache_depth;
+    }
+    atomic_init(&tcache_depth[i], depth);
+  }
+
+  if (current_cpu() >= 0) {
+    arena_mode = ARENA_PER_CPU;
+  }
+
+  long page = sysconf(_SC_PAGESIZE);
+  if (page > 0) {
+    page_size = (size_t)page;
+  }
+  segment_initial_size =
+      (segment_initial_size + page_size - 1) & ~(page_size - 1);
+  if (segment_max_size < segment_initial_size) {
+    segment_max_size = segment_initial_size;
+  }
+
+  reserve_slab_region();
+#ifdef TINYMALLOC_DEBUG
+  for (size_t i = 0; i < DEBUG_SHARDS; i++) {
+    pthread_mutex_init(&debug_shards[i].lock, NULL);
+  }
+#endif
+  thread_key_created = pthread_key_create(&thread_key, thread_teardown) == 0;
+#ifndef __GNUC__
+  register_fork_handlers();
+#endif
+}
+
+/* thread_setup */
+// assigns the calling thread an arena and registers its cache, so it's
+// flushed when the thread exits. without a key the cache can't be flushed,
+// so it stays disabled
+static void thread_setup() {
+  pthread_once(&init_once, global_init);
+
+  // with NUMA, the round-robin is over the arenas of the thread's node
+  unsigned int index = atomic_fetch_add(&next_arena, 1);
+  int cpu = current_cpu();
+  if (numa_nodes > 1 && cpu >= 0 && cpu < MAX_CPUS) {
+    unsigned int node = arenas[cpu_arena[cpu]].node;
+    index = node_first[node] + index % node_arenas[node];
+  } else {
+    index %= narenas;
+  }
+  thread_arena = &arenas[index];
+  atomic_fetch_add(&thread_arena->nthreads, 1);
+
+  // pthread_setspecific may allocate. until it returns the cache stays
+  // disabled, so that allocation doesn't come back here
+  tcache.state = TCACHE_DISABLED;
+  if (thread_key_created && pthread_setspecific(thread_key, &tcache) == 0) {
+    tcache.state = TCACHE_ACTIVE;
+    stats_register();
+  } else {
+    tcache.state = TCACHE_DISABLED;
+  }
+}
+
+/* choose_arena */
+// returns the arena the calling thread allocates from: its CPU's one in
+// per-CPU mode, otherwise the one it's been assigned
+static arena_t *choose_arena() {
+  if (tcache.state == TCACHE_UNINITIALIZED) {
+    thread_setup();
+  }
+
+  if (arena_mode == ARENA_PER_CPU) {
+    int cpu = current_cpu();
+    if (cpu >= 0) {
+      return cpu < MAX_CPUS ? &arenas[cpu_arena[cpu]]
+                            : &arenas[(unsigned int)cpu % narenas];
+    }
+  }
+
+  if (thread_contention >= ARENA_CONTENTION_LIMIT) {
+    arena_rebalance();
+  }
+  return thread_arena;
+}
+
+/* tcache_alloc */
+// pops a cached object of a class, refilling the bin from the thread's
+// arena if it's empty. returns NULL if the cache is unusable or the slabs
+// are exhausted
+static void *tcache_alloc(size_t class_idx) {
+  if (tcache.state != TCACHE_ACTIVE) {
+    if (tcache.state == TCACHE_DISABLED) {
+      return NULL;
+    }
+    thread_setup();
+    if (tcache.state != TCACHE_ACTIVE) {
+      return NULL;
+    }
+  }
+
+  tcache_bin_t *bin = &tcache.bins[class_idx];
+  if (bin->head == NULL) {
+    arena_t *arena = choose_arena();
+    unsigned int depth =
+        atomic_load_explicit(&tcache_depth[class_idx], memory_order_relaxed);
+    uint32_t batch = depth > 1 ? depth / 2 : depth;
+    if (batch == 0) {
+      return NULL;
+    }
+    stat_add(STAT_TCACHE_MISSES, 1);
+
+    // objects are chained in the order the slabs hand them out, so a
+    // refilled bin still gives out ascending addresses
+    void **tail = &bin->head;
+    slab_bin_t *slabs = &arena->slab_bins[class_idx];
+    lock_counted(arena, &slabs->lock);
+    arena_drain_remote(arena, &slabs->remote);
+    while (bin->count < batch) {
+      void *ptr = slab_alloc(arena, class_idx);
+      if (ptr == NULL) {
+        break;
+      }
+      *tail = ptr;
+      tail = (void **)ptr;
+      bin->count++;
+    }
+    *tail = NULL;
+    pthread_mutex_unlock(&slabs->lock);
+    TM_TRACE(TCACHE_REFILL, bin->head, bin->count, class_idx);
+
+    if (bin->head == NULL) {
+      return NULL;
+    }
+  } else {
+    stat_add(STAT_TCACHE_HITS, 1);
+  }
+
+  void *ptr = bin->head;
+  bin->head = *(void **)ptr;
+  bin->count--;
+  return ptr;
+}
+
+/* tcache_free */
+// caches a freed slab object. a full bin has half of it flushed first, or
+// with flush unset makes the call fail. returns false if the object must
+// go straight back to its slab
+static bool tcache_free(void *ptr, size_t class_idx, bool flush) {
+  if (tcache.state != TCACHE_ACTIVE) {
+    if (tcache.state == TCACHE_DISABLED) {
+      return false;
+    }
+    thread_setup();
+    if (tcache.state != TCACHE_ACTIVE) {
+      return false;
+    }
+  }
+
+  tcache_bin_t *bin = &tcache.bins[class_idx];
+  unsigned int depth =
+      atomic_load_explicit(&tcache_depth[class_idx], memory_order_relaxed);
+  if (depth == 0) {
+    return false;
+  }
+  if (bin->count >= depth) {
+    if (!flush) {
+      return false;
+    }
+    tcache_flush(bin, bin->count - depth / 2, choose_arena());
+  }
+
+  *(void **)ptr = bin->head;
+  bin->head = ptr;
+  bin->count++;
+  stat_add(STAT_FREES + class_idx, 1);
+  return true;
+}
+
+/* tcache_take */
+// pops up to n cached objects of a class into out in one go, cutting the
+// front of the bin off its list. returns how many it popped
+static size_t tcache_take(size_t class_idx, void **out, size_t n) {
+  if (tcache.state != TCACHE_ACTIVE) {
+    return 0;
+  }
+
+  tcache_bin_t *bin = &tcache.bins[class_idx];
+  void *ptr = bin->head;
+  size_t taken = 0;
+  while (taken < n && ptr) {
+    out[taken++] = ptr;
+    ptr = *(void **)ptr;
+  }
+  bin->head = ptr;
+  bin->count -= (uint32_t)taken;
+  return taken;
+}
+
+/* tinymalloc_set_tcache_depth */
+int tinymalloc_set_tcache_depth(size_t size, unsigned int depth) {
+  if (size == 0 || size > SLAB_MAX || depth > TCACHE_MAX_DEPTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_once(&init_once, global_init);
+  atomic_store(&tcache_depth[size_to_slab_class(size)], depth);
+  return 0;
+}
+
+/* tinymalloc_set_large_threshold */
+int tinymalloc_set_large_threshold(size_t bytes) {
+  if (bytes <= SLAB_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  atomic_store(&large_threshold, bytes);
+  return 0;
+}
+
+/* tinymalloc_set_decay */
+void tinymalloc_set_decay(unsigned int ms) { atomic_store(&decay_ms, ms); }
+
+/* tinymalloc_set_deferred_coalescing */
+// blocks deferred already stay so until their arena's next pass
+void tinymalloc_set_deferred_coalescing(unsigned int blocks) {
+  atomic_store(&deferred_coalescing, blocks);
+}
+
+/* arena_trim */
+// gives back everything an arena doesn't use: segments holding a single
+// free block are unmapped, the other free runs and the empty slabs are
+// purged. the caller holds the heap lock
+static size_t arena_trim(arena_t *arena) {
+  size_t released = 0;
+  coalesce(arena);
+
+  for (segment_t **link = &arena->segments; *link;) {
+    segment_t *segment = *link;
+    memory_block_t *block =
+        (memory_block_t *)((char *)segment + SEGMENT_HEADER);
+    if (block_in_use(block) ||
+        block_size(block) !=
+            segment->size - SEGMENT_HEADER - sizeof(memory_block_t)) {
+      link = &segment->next;
+      continue;
+    }
+
+    remove_from_free_list(arena, block);
+    arena->segment_bytes -= segment->size;
+    *link = segment->next;
+    TM_TRACE(UNMAP, segment, segment->size, arena->index);
+    released += segment->size;
+    pagemap_set(segment, segment->size, PAGE_FOREIGN);
+    os_unmap(segment, segment->size);
+  }
+
+  released += arena_purge(arena, false);
+
+  // an empty slab's header is rewritten when it's reused, only the first
+  // page holding it stays. slabs an earlier trim purged have nothing more
+  // to give until they're reused
+  pthread_mutex_lock(&arena->slab_lock);
+  for (slab_t *slab = arena->empty_slabs; slab && page_size < SLAB_SIZE;
+       slab = slab->next) {
+    if (!slab->purged && madvise((char *)slab + page_size,
+                                 SLAB_SIZE - page_size, MADV_DONTNEED) == 0) {
+      slab->purged = true;
+      released += SLAB_SIZE - page_size;
+    }
+  }
+  pthread_mutex_unlock(&arena->slab_lock);
+  return released;
+}
+
+/* tinymalloc_trim */
+// the calling thread's cache is flushed first, so its objects don't keep
+// slabs from being empty
+size_t tinymalloc_trim(void) {
+  arena_t *current = choose_arena();
+  if (tcache.state == TCACHE_ACTIVE) {
+    for (size_t i = 0; i < NUM_SLAB_CLASSES; i++) {
+      tcache_flush(&tcache.bins[i], tcache.bins[i].count, current);
+    }
+  }
+
+  // queued objects are freed first, they may empty slabs and free runs
+  size_t released = 0;
+  for (unsigned int i = 0; i < narenas; i++) {
+    arena_t *arena = &arenas[i];
+    for (size_t c = 0; c < NUM_SLAB_CLASSES; c++) {
+      pthread_mutex_lock(&arena->slab_bins[c].lock);
+      arena_drain_remote(arena, &arena->slab_bins[c].remote);
+      pthread_mutex_unlock(&arena->slab_bins[c].lock);
+    }
+    pthread_mutex_lock(&arena->lock);
+    arena_drain_remote(arena, &arena->remote);
+    released += arena_trim(arena);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return released;
+}
+
+/* tinymalloc_numa_nodes */
+unsigned int tinymalloc_numa_nodes(void) {
+  pthread_once(&init_once, global_init);
+  return numa_nodes;
+}
+
+/* tinymalloc_node_stats */
+// sums the usage of the arenas bound to a node, each read under the lock
+// covering it
+int tinymalloc_node_stats(unsigned int node, tinymalloc_node_stats_t *stats) {
+  pthread_once(&init_once, global_init);
+  if (node >= numa_nodes || stats == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+  for (unsigned int i = 0; i < narenas; i++) {
+    arena_t *arena = &arenas[i];
+    if (arena->node != node) {
+      continue;
+    }
+    stats->arenas++;
+    pthread_mutex_lock(&arena->lock);
+    stats->segment_bytes += arena->segment_bytes;
+    pthread_mutex_unlock(&arena->lock);
+    pthread_mutex_lock(&arena->slab_lock);
+    stats->slab_bytes += arena->slab_bytes;
+    pthread_mutex_unlock(&arena->slab_lock);
+    stats->remote_frees += atomic_load(&arena->remote_frees);
+  }
+  return 0;
+}
+
+/* tinymalloc_stats */
+// the counters are summed first, then the arenas are walked for what's
+// mapped and free, each under the lock covering it
+void tinymalloc_stats(tinymalloc_stats_t *stats) {
+  pthread_once(&init_once, global_init);
+
+  uint64_t counters[NUM_STATS];
+  pthread_mutex_lock(&stats_lock);
+  for (size_t i = 0; i < NUM_STATS; i++) {
+    counters[i] = atomic_load_explicit(&retired_stats[i], memory_order_relaxed);
+  }
+  for (thread_stats_t *thread = stats_threads; thread; thread = thread->next) {
+    for (size_t i = 0; i < NUM_STATS; i++) {
+      counters[i] +=
+          atomic_load_explicit(&thread->counters[i], memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  // threads are summed one after the other, so a net count can briefly
+  // come out negative
+  memset(stats, 0, sizeof(*stats));
+  int64_t allocated =
+      (int64_t)counters[STAT_HEAP_BYTES] + (int64_t)counters[STAT_LARGE_BYTES];
+  for (size_t c = 0; c < NUM_STAT_CLASSES; c++) {
+    tinymalloc_class_stats_t *class_stats = &stats->classes[c];
+    class_stats->size = c < NUM_SLAB_CLASSES ? slab_class_size[c] : 0;
+    class_stats->allocs = counters[STAT_ALLOCS + c];
+    class_stats->frees = counters[STAT_FREES + c];
+    allocated += (int64_t)(class_stats->allocs - class_stats->frees) *
+                 (int64_t)class_stats->size;
+  }
+  stats->allocated = allocated > 0 ? (size_t)allocated : 0;
+
+  stats->mapped = (size_t)counters[STAT_LARGE_BYTES];
+  for (unsigned int i = 0; i < narenas; i++) {
+    arena_t *arena = &arenas[i];
+    pthread_mutex_lock(&arena->lock);
+    stats->mapped += arena->segment_bytes;
+    stats->free += arena->deferred_bytes;
+    for (size_t bin = 0; bin < NUM_BINS; bin++) {
+      for (memory_block_t *block = arena->bins[bin]; block;
+           block = free_links(block)->next_free) {
+        stats->free += block_size(block);
+      }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    pthread_mutex_lock(&arena->slab_lock);
+    stats->mapped += arena->slab_bytes;
+    for (slab_t *slab = arena->empty_slabs; slab; slab = slab->next) {
+      stats->free += SLAB_SIZE;
+    }
+    pthread_mutex_unlock(&arena->slab_lock);
+  }
+  if (stats->mapped > stats->allocated + stats->free) {
+    stats->fragmented = stats->mapped - stats->allocated - stats->free;
+  }
+
+  stats->mmap_calls = counters[STAT_MMAP_CALLS];
+  stats->munmap_calls = counters[STAT_MUNMAP_CALLS];
+  stats->lock_contention = counters[STAT_CONTENTION];
+  stats->tcache_hits = counters[STAT_TCACHE_HITS];
+  stats->tcache_misses = counters[STAT_TCACHE_MISSES];
+}
+
+/* ctl_copy */
+// hands a value of tinymalloc_ctl out. with oldp unset only its size is
+static int ctl_copy(void *oldp, size_t *oldlenp, const void *value,
+                    size_t len) {
+  if (oldp) {
+    if (*oldlenp != len) {
+      return EINVAL;
+    }
+    memcpy(oldp, value, len);
+  }
+  if (oldlenp) {
+    *oldlenp = len;
+  }
+  return 0;
+}
+
+static const struct {
+  const char *name;
+  size_t offset;
+  size_t size;
+} ctl_stats_fields[] = {
+    {"mapped", offsetof(tinymalloc_stats_t, mapped), sizeof(size_t)},
+    {"allocated", offsetof(tinymalloc_stats_t, allocated), sizeof(size_t)},
+    {"free", offsetof(tinymalloc_stats_t, free), sizeof(size_t)},
+    {"fragmented", offsetof(tinymalloc_stats_t, fragmented), sizeof(size_t)},
+    {"mmap_calls", offsetof(tinymalloc_stats_t, mmap_calls), sizeof(uint64_t)},
+    {"munmap_calls", offsetof(tinymalloc_stats_t, munmap_calls),
+     sizeof(uint64_t)},
+    {"lock_contention", offsetof(tinymalloc_stats_t, lock_contention),
+     sizeof(uint64_t)},
+    {"tcache_hits", offsetof(tinymalloc_stats_t, tcache_hits),
+     sizeof(uint64_t)},
+    {"tcache_misses", offsetof(tinymalloc_stats_t, tcache_misses),
+     sizeof(uint64_t)},
+};
+
+/* ctl_stats */
+// reads "stats." names: the fields above, "classes", the number of
+// classes, and "class.<i>.size", "class.<i>.allocs" or "class.<i>.frees"
+static int ctl_stats(const char *name, void *oldp, size_t *oldlenp) {
+  if (strcmp(name, "classes") == 0) {
+    unsigned int classes = NUM_STAT_CLASSES;
+    return ctl_copy(oldp, oldlenp, &classes, sizeof(classes));
+  }
+
+  const void *value = NULL;
+  size_t len = 0;
+  tinymalloc_stats_t stats;
+  if (strncmp(name, "class.", 6) == 0) {
+    char *field;
+    unsigned long c = strtoul(name + 6, &field, 10);
+    if (field == name + 6 || *field != '.' || c >= NUM_STAT_CLASSES) {
+      return ENOENT;
+    }
+    tinymalloc_stats(&stats);
+    tinymalloc_class_stats_t *class_stats = &stats.classes[c];
+    if (strcmp(field, ".size") == 0) {
+      value = &class_stats->size;
+      len = sizeof(size_t);
+    } else if (strcmp(field, ".allocs") == 0) {
+      value = &class_stats->allocs;
+      len = sizeof(uint64_t);
+    } else if (strcmp(field, ".frees") == 0) {
+      value = &class_stats->frees;
+      len = sizeof(uint64_t);
+    } else {
+      return ENOENT;
+    }
+    return ctl_copy(oldp, oldlenp, value, len);
+  }
+
+  for (size_t i = 0; i < sizeof(ctl_stats_fields) / sizeof(*ctl_stats_fields);
+       i++) {
+    if (strcmp(name, ctl_stats_fields[i].name) == 0) {
+      tinymalloc_stats(&stats);
+      return ctl_copy(oldp, oldlenp,
+                      (const char *)&stats + ctl_stats_fields[i].offset,
+                      ctl_stats_fields[i].size);
+    }
+  }
+  return ENOENT;
+}
+
+/* ctl_opt */
+// reads and writes "opt." names. the old value is handed out before the
+// new one is set
+static int ctl_opt(const char *name, void *oldp, size_t *oldlenp,
+                   const void *newp, size_t newlen) {
+  if (strcmp(name, "decay_ms") == 0) {
+    unsigned int ms = atomic_load(&decay_ms);
+    int err = ctl_copy(oldp, oldlenp, &ms, sizeof(ms));
+    if (err == 0 && newp) {
+      if (newlen != sizeof(ms)) {
+        return EINVAL;
+      }
+      memcpy(&ms, newp, sizeof(ms));
+      tinymalloc_set_decay(ms);
+    }
+    return err;
+  }
+
+  if (strcmp(name, "deferred_coalescing") == 0) {
+    unsigned int blocks = atomic_load(&deferred_coalescing);
+    int err = ctl_copy(oldp, oldlenp, &blocks, sizeof(blocks));
+    if (err == 0 && newp) {
+      if (newlen != sizeof(blocks)) {
+        return EINVAL;
+      }
+      memcpy(&blocks, newp, sizeof(blocks));
+      tinymalloc_set_deferred_coalescing(blocks);
+    }
+    return err;
+  }
+
+  if (strcmp(name, "large_threshold") == 0) {
+    size_t bytes = atomic_load(&large_threshold);
+    int err = ctl_copy(oldp, oldlenp, &bytes, sizeof(bytes));
+    if (err == 0 && newp) {
+      if (newlen != sizeof(bytes)) {
+        return EINVAL;
+      }
+      memcpy(&bytes, newp, sizeof(bytes));
+      return tinymalloc_set_large_threshold(bytes) == 0 ? 0 : EINVAL;
+    }
+    return err;
+  }
+
+  if (strcmp(name, "sample_interval") == 0) {
+    size_t bytes = atomic_load(&sample_interval);
+    int err = ctl_copy(oldp, oldlenp, &bytes, sizeof(bytes));
+    if (err == 0 && newp) {
+      if (newlen != sizeof(bytes)) {
+        return EINVAL;
+      }
+      memcpy(&bytes, newp, sizeof(bytes));
+      tinymalloc_set_sample_interval(bytes);
+    }
+    return err;
+  }
+
+  if (strcmp(name, "huge_pages") == 0) {
+    int mode = atomic_load(&huge_pages);
+    int err = ctl_copy(oldp, oldlenp, &mode, sizeof(mode));
+    if (err == 0 && newp) {
+      if (newlen != sizeof(mode)) {
+        return EINVAL;
+      }
+      memcpy(&mode, newp, sizeof(mode));
+      return tinymalloc_set_huge_pages(mode) == 0 ? 0 : EINVAL;
+    }
+    return err;
+  }
+
+  return ENOENT;
+}
+
+/* tinymalloc_ctl */
+int tinymalloc_ctl(const char *name, void *oldp, size_t *oldlenp,
+                   const void *newp, size_t newlen) {
+  if (name == NULL) {
+    return ENOENT;
+  }
+  if (oldp && oldlenp == NULL) {
+    return EINVAL;
+  }
+
+  if (strncmp(name, "opt.", 4) == 0) {
+    return ctl_opt(name + 4, oldp, oldlenp, newp, newlen);
+  }
+  if (strncmp(name, "stats.", 6) == 0) {
+    return newp ? EPERM : ctl_stats(name + 6, oldp, oldlenp);
+  }
+  return ENOENT;
+}
+
+/* large_alloc */
+// maps a block of its own for size bytes, rounded up to whole pages, with
+// the payload aligned to alignment. alignments past a page are had by
+// mapping extra and unmapping the slack around the aligned part
+static void *large_alloc(size_t size, size_t alignment) {
+  pthread_once(&init_once, global_init);
+
+  // the tag goes in the first page of the mapping, right before the payload
+  size_t offset = alignment < page_size ? alignment : page_size;
+  size_t slack = alignment - offset;
+  if (size > SIZE_MAX - offset - slack - page_size) {
+    return NULL;
+  }
+  size_t length = (offset + size + page_size - 1) & ~(page_size - 1);
+  if (length > TAG_SIZE_MASK) {
+    return NULL;
+  }
+
+  char *mapped = os_map(length + slack, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS);
+  if (mapped == MAP_FAILED) {
+    return NULL; // OOM
+  }
+
+  char *base = mapped;
+  if (slack > 0) {
+    uintptr_t payload = ((uintptr_t)mapped + offset + alignment - 1) &
+                        ~(uintptr_t)(alignment - 1);
+    base = (char *)payload - offset;
+    if (base > mapped) {
+      os_unmap(mapped, base - mapped);
+    }
+    if (mapped + slack > base) {
+      os_unmap(base + length, mapped + slack - base);
+    }
+  }
+  if (!pagemap_set(base, length, PAGE_LARGE)) {
+    os_unmap(base, length);
+    return NULL;
+  }
+
+  memory_block_t *block =
+      (memory_block_t *)(base + offset - sizeof(memory_block_t));
+  block->tag = make_tag(length, TAG_IN_USE, ARENA_LARGE);
+  TM_TRACE(MAP, base, length, ARENA_LARGE);
+  stat_add(STAT_ALLOCS + STAT_LARGE_CLASS, 1);
+  stat_add(STAT_LARGE_BYTES, length);
+  return (void *)(block + 1);
+}
+
+/* map_segment */
+// maps length bytes for a segment, or more with huge pages on, in which
+// case length is updated. returns NULL if nothing can be mapped
+static void *map_segment(size_t *length) {
+  int mode = atomic_load_explicit(&huge_pages, memory_order_relaxed);
+  if (mode != TINYMALLOC_HUGE_NONE &&
+      *length <= SIZE_MAX - 2 * HUGE_PAGE_SIZE) {
+    size_t huge_length =
+        (*length + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    char *mapped;
+#ifdef MAP_HUGETLB
+    // explicit huge pages are reserved by mmap, so a mapping that succeeds
+    // never faults for lack of them
+    if (mode == TINYMALLOC_HUGE_HUGETLB) {
+      mapped = os_map(huge_length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB);
+      if (mapped != MAP_FAILED) {
+        *length = huge_length;
+        return mapped;
+      }
+    }
+#endif
+
+    // a huge page more than needed is mapped, and the slack around the
+    // aligned part unmapped
+    mapped = os_map(huge_length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS);
+    if (mapped != MAP_FAILED) {
+      char *aligned =
+          (char *)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) &
+                   ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+      if (aligned > mapped) {
+        os_unmap(mapped, aligned - mapped);
+      }
+      os_unmap(aligned + huge_length, mapped + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+      madvise(aligned, huge_length, MADV_HUGEPAGE);
+#endif
+      *length = huge_length;
+      return aligned;
+    }
+  }
+
+  void *mapped =
+      os_map(*length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+  return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+/* tinymalloc_set_huge_pages */
+int tinymalloc_set_huge_pages(int mode) {
+  if (mode != TINYMALLOC_HUGE_NONE && mode != TINYMALLOC_HUGE_THP &&
+      mode != TINYMALLOC_HUGE_HUGETLB) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  atomic_store(&huge_pages, mode);
+  return 0;
+}
+
+/* large_free */
+static void large_free(memory_block_t *block) {
+  void *base = (void *)((uintptr_t)block & ~(uintptr_t)(page_size - 1));
+  TM_TRACE(UNMAP, base, block_size(block), ARENA_LARGE);
+  stat_add(STAT_FREES + STAT_LARGE_CLASS, 1);
+  stat_sub(STAT_LARGE_BYTES, block_size(block));
+  pagemap_set(base, block_size(block), PAGE_FOREIGN);
+  os_unmap(base, block_size(block));
+}
+
+/* extend_heap */
+// maps a new segment big enough for a block of size bytes, its tag
+// included, and puts it in
+// the free lists as one free block, which is returned. the caller holds
+// the arena's lock
+memory_block_t *extend_heap(arena_t *arena, size_t size) {
+  size_t length = arena->segment_size;
+  if (length == 0) {
+    length = segment_initial_size;
+  }
+  if (size > TAG_SIZE_MASK - SEGMENT_HEADER - sizeof(memory_block_t) -
+                 page_size) {
+    return NULL;
+  }
+
+  // a block bigger than the next segment gets a segment of its own size.
+  // the segment header comes before the first block, the fence after the
+  // last one
+  size_t needed = SEGMENT_HEADER + size + sizeof(memory_block_t);
+  if (needed > length) {
+    length = (needed + page_size - 1) & ~(page_size - 1);
+  }
+
+  segment_t *segment = map_segment(&length);
+  if (segment == NULL) {
+    return NULL; // OOM
+  }
+  if (!pagemap_set(segment, length, PAGE_HEAP)) {
+    os_unmap(segment, length);
+    return NULL;
+  }
+  TM_TRACE(MAP, segment, length, arena->index);
+
+  numa_bind(segment, length, arena->node);
+  arena->segment_bytes += length;
+  segment->size = length;
+  segment->next = arena->segments;
+  arena->segments = segment;
+  if (arena->segment_size < segment_max_size) {
+    arena->segment_size = length < segment_max_size / 2 ? length * 2
+                                                        : segment_max_size;
+  }
+
+  memory_block_t *block = (memory_block_t *)((char *)segment + SEGMENT_HEADER);
+  size_t size_left = length - SEGMENT_HEADER - sizeof(memory_block_t);
+  block->tag =
+      make_tag(size_left, TAG_PREV_IN_USE | TAG_ZEROED, arena->index);
+  next_block(block)->tag = make_tag(0, TAG_IN_USE, arena->index); // fence
+  mark_free(block);
+  insert_free_block(arena, block);
+  return block;
+}
+
+/* initialize_heap */
+// maps the first segment of an arena
+void *initialize_heap(arena_t *arena) {
+  memory_block_t *block = extend_heap(arena, 0);
+  if (block) {
+    TM_TRACE(HEAP_INIT, arena->segments, arena->segments->size, arena->index);
+  }
+  return block;
+}
+
+/* request_to_block_size */
+// the block for a request holds the tag and at least size bytes, rounded up
+// to a multiple of ALIGNMENT. once freed it must fit its links and footer
+static size_t request_to_block_size(size_t size) {
+  size_t needed =
+      (size + sizeof(memory_block_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  return needed < MIN_BLOCK ? MIN_BLOCK : needed;
+}
+
+/* usable_size */
+// returns how many bytes the caller may use at ptr
+static size_t usable_size(void *ptr) {
+  if (is_slab_ptr(ptr)) {
+    return ptr_to_slab(ptr)->object_size;
+  }
+
+  memory_block_t *block = ((memory_block_t *)ptr) - 1;
+  size_t size = (size_t)(block_tag(block) & TAG_SIZE_MASK);
+  if (block_arena(block) == ARENA_LARGE) {
+    uintptr_t base = (uintptr_t)block & ~(uintptr_t)(page_size - 1);
+    return size - ((uintptr_t)ptr - base);
+  }
+  return size - sizeof(memory_block_t);
+}
+
+/* shrink_block */
+// cuts an in-use block down to size bytes, freeing the tail if it's big
+// enough to be a block. the caller holds the arena's lock
+static void shrink_block(arena_t *arena, memory_block_t *block, size_t size) {
+  size_t total = block_size(block);
+  if (total < size + MIN_BLOCK) {
+    return;
+  }
+
+  memory_block_t *tail = (memory_block_t *)((char *)block + size);
+  tail->tag =
+      make_tag(total - size, TAG_IN_USE | TAG_PREV_IN_USE, block_arena(block));
+  block->tag = (block->tag & ~TAG_SIZE_MASK) | size;
+  TM_TRACE(SPLIT, block, size, total - size);
+  coalesce_block(arena, tail);
+}
+
+/* resize_block */
+// resizes an in-use block without moving it: a shrink frees the tail, a
+// grow absorbs the next block if it's free and big enough. returns false
+// if the block can't grow in place
+static bool resize_block(memory_block_t *block, size_t size) {
+  arena_t *arena = &arenas[block_arena(block)];
+  arena_lock(arena);
+  size_t old_size = block_size(block);
+
+  memory_block_t *next = next_block(block);
+  if (size > block_size(block)) {
+    if (block_in_use(next) || block_size(block) + block_size(next) < size) {
+      arena_unlock(arena);
+      return false;
+    }
+    TM_TRACE(COALESCE, block, block_size(next), next);
+    remove_from_free_list(arena, next);
+    block->tag += block_size(next);
+    mark_in_use(block);
+  }
+
+  shrink_block(arena, block, size);
+  stat_add(STAT_HEAP_BYTES, (uint64_t)block_size(block) - old_size);
+  arena_unlock(arena);
+  return true;
+}
+
+/* large_resize */
+// remaps a large allocation to fit size bytes, letting the kernel move its
+// pages rather than copying them. returns NULL if the mapping can't change
+static void *large_resize(void *ptr, size_t size) {
+#ifdef __linux__
+  memory_block_t *block = ((memory_block_t *)ptr) - 1;
+  char *base = (char *)((uintptr_t)block & ~(uintptr_t)(page_size - 1));
+  size_t offset = (char *)ptr - base;
+  if (size > SIZE_MAX - offset - page_size) {
+    return NULL;
+  }
+
+  size_t old_length = block_size(block);
+  size_t length = (offset + size + page_size - 1) & ~(page_size - 1);
+  if (length == old_length) {
+    return ptr;
+  }
+  if (length > TAG_SIZE_MASK) {
+    return NULL;
+  }
+
+  // the old range is cleared first, as by large_free, since the kernel may
+  // hand it to someone else as soon as the mapping moves. a new range whose
+  // leaf can't be mapped stays unregistered, its memory is leaked by free
+  stat_add(STAT_MMAP_CALLS, 1);
+  pagemap_set(base, old_length, PAGE_FOREIGN);
+  char *moved = mremap(base, old_length, length, MREMAP_MAYMOVE);
+  if (moved == MAP_FAILED) {
+    pagemap_set(base, old_length, PAGE_LARGE);
+    return NULL;
+  }
+  pagemap_set(moved, length, PAGE_LARGE);
+  stat_add(STAT_LARGE_BYTES, (uint64_t)length - old_length);
+  TM_TRACE(UNMAP, base, old_length, ARENA_LARGE);
+  TM_TRACE(MAP, moved, length, ARENA_LARGE);
+
+  block = (memory_block_t *)(moved + offset - sizeof(memory_block_t));
+  block->tag = make_tag(length, TAG_IN_USE, ARENA_LARGE);
+  return moved + offset;
+#else
+  (void)ptr;
+  (void)size;
+  return NULL;
+#endif
+}
+
+/* small_alloc */
+// serves an object of a slab class, through the thread cache when
+// possible. returns NULL if no slab can be had
+static void *small_alloc(size_t class_idx) {
+  void *ptr = tcache_alloc(class_idx);
+  if (ptr == NULL) {
+    arena_t *arena = choose_arena();
+    slab_bin_t *slabs = &arena->slab_bins[class_idx];
+    lock_counted(arena, &slabs->lock);
+    arena_drain_remote(arena, &slabs->remote);
+    ptr = slab_alloc(arena, class_idx);
+    pthread_mutex_unlock(&slabs->lock);
+  }
+  if (ptr) {
+    stat_add(STAT_ALLOCS + class_idx, 1);
+  }
+  return ptr;
+}
+
+/* split_leading */
+// frees the first offset bytes of a free block, which is out of the free
+// lists, as a block of their own and returns the block that follows them.
+// offset is 0 or big enough to be a block
+static memory_block_t *split_leading(arena_t *arena, memory_block_t *block,
+                                     size_t offset) {
+  if (offset == 0) {
+    return block;
+  }
+
+  memory_block_t *rest = (memory_block_t *)((char *)block + offset);
+  rest->tag = make_tag(block_size(block) - offset,
+                       block->tag & (TAG_ZEROED | TAG_PURGED),
+                       block_arena(block));
+  block->tag = (block->tag & ~TAG_SIZE_MASK) | offset;
+  mark_free(block);
+  insert_free_block(arena, block);
+  TM_TRACE(SPLIT, block, offset, block_size(rest));
+  return rest;
+}
+
+static memory_block_t *take_block(arena_t *arena, size_t size,
+                                  size_t alignment);
+
+/* block_alloc */
+// serves a request from the free blocks of the caller's arena. with zero
+// set the payload is cleared, unless the block is known to be zero
+// already: then only the words its free-list links and footer took are
+static void *block_alloc(size_t size, size_t alignment, bool zero) {
+  arena_t *arena = choose_arena();
+  arena_lock(arena);
+  arena_drain_remote(arena, &arena->remote);
+  arena_decay(arena, false);
+  memory_block_t *block = take_block(arena, size, alignment);
+  // once unlocked, the tag may change under a neighbour's free, so what's
+  // needed of it is read now
+  size_t total = block ? block_size(block) : 0;
+  bool zeroed = block && (block->tag & TAG_ZEROED) != 0;
+  arena_unlock(arena);
+  if (block == NULL) {
+    return NULL;
+  }
+  stat_add(STAT_ALLOCS + STAT_HEAP_CLASS, 1);
+  stat_add(STAT_HEAP_BYTES, total);
+
+  if (zero && zeroed) {
+    memset(block + 1, 0, sizeof(free_links_t));
+    memset((char *)block + total - sizeof(uint64_t), 0, sizeof(uint64_t));
+  } else if (zero) {
+    memset(block + 1, 0, size);
+  }
+  return (void *)(block + 1);
+}
+
+/* take_block */
+// carves an in-use block for size bytes out of the free blocks of an
+// arena, growing its heap if none fits. the payload is aligned to
+// alignment: past ALIGNMENT, a block with room to spare is found and the
+// slack before the aligned part goes back to the free lists. the caller
+// holds the arena's lock
+static memory_block_t *take_block(arena_t *arena, size_t size,
+                                  size_t alignment) {
+  size_t needed = request_to_block_size(size);
+  size_t search = needed;
+  if (alignment > ALIGNMENT) {
+    search += alignment + MIN_BLOCK;
+  }
+
+  if (arena->segments == NULL && initialize_heap(arena) == NULL) {
+    return NULL;
+  }
+
+  // a deferred block is still tagged in use, it's handed out as it is
+  memory_block_t *block =
+      alignment <= ALIGNMENT ? quick_take(arena, needed) : NULL;
+  if (block) {
+    return block;
+  }
+
+  // a miss merges the deferred blocks before the bins are searched again,
+  // and if none can satisfy the request, the heap grows by a segment
+  block = find_free_block(arena, search);
+  if (block == NULL && arena->deferred > 0) {
+    coalesce(arena);
+    block = find_free_block(arena, search);
+  }
+  if (block == NULL && (block = extend_heap(arena, search)) == NULL) {
+    return NULL;
+  }
+
+  remove_from_free_list(arena, block);
+  if (alignment > ALIGNMENT) {
+    uintptr_t payload = (uintptr_t)(block + 1);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    while (aligned != payload && aligned - payload < MIN_BLOCK) {
+      aligned += alignment;
+    }
+    block = split_leading(arena, block, aligned - payload);
+  }
+  split_block(arena, block, needed);
+  mark_in_use(block);
+  return block;
+}
+
+/* slab_class_for */
+// returns the smallest slab class fitting size whose slots are all aligned
+// to alignment, or NUM_SLAB_CLASSES if there is none. every class is
+// aligned to ALIGNMENT, and past it a class can only be as aligned as the
+// first slot of its slabs
+static size_t slab_class_for(size_t size, size_t alignment) {
+  size_t class_idx = size_to_slab_class(size);
+  if (alignment <= ALIGNMENT) {
+    return class_idx;
+  }
+  if (SLAB_DATA_OFFSET % alignment != 0) {
+    return NUM_SLAB_CLASSES;
+  }
+
+  while (class_idx < NUM_SLAB_CLASSES &&
+         slab_class_size[class_idx] % alignment != 0) {
+    class_idx++;
+  }
+  return class_idx;
+}
+
+/* profile_setup */
+static void profile_setup() {
+  site_pool = tiny_pool_create(sizeof(profile_site_t), _Alignof(void *));
+  sample_pool = tiny_pool_create(sizeof(profile_sample_t), _Alignof(void *));
+}
+
+/* neg_log */
+// -ln(u) for u in (0, 1], without libm: u is m * 2^e with m in [1, 2),
+// and ln(m) = 2 atanh((m - 1) / (m + 1)), whose series converges fast there
+static double neg_log(double u) {
+  uint64_t bits;
+  memcpy(&bits, &u, sizeof(bits));
+  int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+  bits = (bits & (((uint64_t)1 << 52) - 1)) | (uint64_t)1023 << 52;
+  double m;
+  memcpy(&m, &bits, sizeof(m));
+
+  double t = (m - 1) / (m + 1), t2 = t * t;
+  double ln_m =
+      2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+  return -(exponent * 0.6931471805599453 + ln_m);
+}
+
+/* sample_next */
+// draws the bytes to a thread's next sample, with a xorshift generator
+// seeded per thread
+static int64_t sample_next(size_t interval) {
+  uint64_t x = sample_rng;
+  if (x == 0) {
+    x = ((uintptr_t)&sample_rng ^ now_ms() << 32) | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  sample_rng = x;
+
+  double u = (double)((x >> 11) + 1) * (1.0 / 9007199254740992.0); // 2^-53
+  double next = neg_log(u) * (double)interval;
+  return next < (double)(INT64_MAX / 2) ? (int64_t)next + 1 : INT64_MAX / 2;
+}
+
+/* stack_hash */
+static uint64_t stack_hash(void *const *stack, unsigned int depth) {
+  uint64_t hash = 0xcbf29ce484222325; // FNV-1a over the addresses
+  for (unsigned int i = 0; i < depth; i++) {
+    hash = (hash ^ (uintptr_t)stack[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+/* sample_bucket */
+static profile_sample_t **sample_bucket(void *ptr) {
+  return &profile_samples[((uintptr_t)ptr >> 4) & (PROFILE_SAMPLE_BUCKETS - 1)];
+}
+
+/* profile_record */
+// adds a sample to its site, the spare one if its backtrace is new. returns
+// whether the spare was taken. the caller holds samples_lock
+static bool profile_record(profile_sample_t *sample, profile_site_t *spare) {
+  uint64_t hash = stack_hash(spare->stack, spare->depth);
+  profile_site_t **bucket = &profile_sites[hash & (PROFILE_SITE_BUCKETS - 1)];
+  profile_site_t *site = *bucket;
+  while (site && (site->hash != hash || site->depth != spare->depth ||
+                  memcmp(site->stack, spare->stack,
+                         spare->depth * sizeof(void *)) != 0)) {
+    site = site->next;
+  }
+
+  bool taken = site == NULL;
+  if (taken) {
+    site = spare;
+    site->hash = hash;
+    site->allocs = site->alloc_bytes = site->live = site->live_bytes = 0;
+    site->next = *bucket;
+    *bucket = site;
+  }
+  site->allocs++;
+  site->alloc_bytes += sample->size;
+  site->live++;
+  site->live_bytes += sample->size;
+
+  sample->site = site;
+  profile_sample_t **samples = sample_bucket(sample->ptr);
+  sample->next = *samples;
+  *samples = sample;
+  return taken;
+}
+
+/* profile_alloc */
+// runs when a thread's countdown runs out, and returns a sampled allocation
+// or NULL for the caller to allocate as usual. while profiling is off, and
+// on a thread's first countdown, it only sets the next one
+static void *profile_alloc(size_t size, size_t alignment, bool zero) {
+  size_t interval =
+      atomic_load_explicit(&sample_interval, memory_order_relaxed);
+  if (interval == 0 || !sample_armed) {
+    sample_armed = interval != 0;
+    sample_countdown = interval ? sample_next(interval) : PROFILE_RECHECK;
+    return NULL;
+  }
+
+  // what is allocated from here on, by the pools or backtrace(), is never
+  // sampled itself
+  sample_countdown = INT64_MAX;
+  pthread_once(&profile_once, profile_setup);
+  profile_sample_t *sample = NULL;
+  profile_site_t *spare = NULL;
+  void *ptr = NULL;
+  if (site_pool && sample_pool && (sample = tiny_pool_alloc(sample_pool)) &&
+      (spare = tiny_pool_alloc(site_pool))) {
+#ifdef TINYMALLOC_HAVE_BACKTRACE
+    int depth = backtrace(spare->stack, PROFILE_DEPTH);
+    spare->depth = depth > 0 ? (unsigned int)depth : 0;
+#else
+    spare->depth = 0;
+#endif
+
+    // heap blocks have neighbours setting flags of their tag, so theirs
+    // is marked under their arena's lock
+    size_t threshold =
+        atomic_load_explicit(&large_threshold, memory_order_relaxed);
+    if (size >= threshold || alignment >= threshold - size) {
+      if ((ptr = large_alloc(size, alignment))) {
+        (((memory_block_t *)ptr) - 1)->tag |= TAG_SAMPLED;
+      }
+    } else if ((ptr = block_alloc(size, alignment, zero))) {
+      memory_block_t *block = ((memory_block_t *)ptr) - 1;
+      arena_t *arena = &arenas[block_arena(block)];
+      arena_lock(arena);
+      block->tag |= TAG_SAMPLED;
+      arena_unlock(arena);
+    }
+  }
+
+  if (ptr) {
+    sample->ptr = ptr;
+    sample->size = size;
+    pthread_mutex_lock(&samples_lock);
+    bool taken = profile_record(sample, spare);
+    pthread_mutex_unlock(&samples_lock);
+    sample = NULL;
+    if (taken) {
+      spare = NULL;
+    }
+  }
+  if (sample) {
+    tiny_pool_free(sample_pool, sample);
+  }
+  if (spare) {
+    tiny_pool_free(site_pool, spare);
+  }
+  sample_countdown = sample_next(interval);
+  return ptr;
+}
+
+/* is_sampled */
+// tells whether a block or large allocation is recorded by the profiler
+static bool is_sampled(void *ptr) {
+  return (block_tag(((memory_block_t *)ptr) - 1) & TAG_SAMPLED) != 0;
+}
+
+/* profile_free */
+// drops the sample of an allocation being freed
+static void profile_free(void *ptr) {
+  pthread_mutex_lock(&samples_lock);
+  profile_sample_t **link = sample_bucket(ptr);
+  while (*link && (*link)->ptr != ptr) {
+    link = &(*link)->next;
+  }
+  profile_sample_t *sample = *link;
+  if (sample) {
+    *link = sample->next;
+    sample->site->live--;
+    sample->site->live_bytes -= sample->size;
+  }
+  pthread_mutex_unlock(&samples_lock);
+
+  if (sample) {
+    tiny_pool_free(sample_pool, sample);
+  }
+}
+
+/* tinymalloc_set_sample_interval */
+// the caller's next allocation draws its countdown from the new interval,
+// other threads switch when their current countdown runs out
+void tinymalloc_set_sample_interval(size_t bytes) {
+  atomic_store(&sample_interval, bytes);
+  sample_armed = false;
+  sample_countdown = 0;
+}
+
+/* profile_write */
+// writes the legacy heap profile pprof reads: a header with the totals,
+// one line per site with its live and total samples and its backtrace, and
+// the mappings to symbolize the addresses with. the caller holds
+// samples_lock
+static bool profile_write(int fd) {
+  unsigned long long live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+  for (size_t i = 0; i < PROFILE_SITE_BUCKETS; i++) {
+    for (profile_site_t *site = profile_sites[i]; site; site = site->next) {
+      live += site->live;
+      live_bytes += site->live_bytes;
+      allocs += site->allocs;
+      alloc_bytes += site->alloc_bytes;
+    }
+  }
+
+  char line[64 + PROFILE_DEPTH * 20];
+  int len = snprintf(line, sizeof(line),
+                     "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%zu\n",
+                     live, live_bytes, allocs, alloc_bytes,
+                     atomic_load(&sample_interval));
+  if (!write_all(fd, line, (size_t)len)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < PROFILE_SITE_BUCKETS; i++) {
+    for (profile_site_t *site = profile_sites[i]; site; site = site->next) {
+      len = snprintf(line, sizeof(line), "%6llu: %8llu [%6llu: %8llu] @",
+                     (unsigned long long)site->live,
+                     (unsigned long long)site->live_bytes,
+                     (unsigned long long)site->allocs,
+                     (unsigned long long)site->alloc_bytes);
+      for (unsigned int frame = 0; frame < site->depth; frame++) {
+        len += snprintf(line + len, sizeof(line) - (size_t)len, " %p",
+                        site->stack[frame]);
+      }
+      line[len++] = '\n';
+      if (!write_all(fd, line, (size_t)len)) {
+        return false;
+      }
+    }
+  }
+
+  const char maps_header[] = "\nMAPPED_LIBRARIES:\n";
+  if (!write_all(fd, maps_header, sizeof(maps_header) - 1)) {
+    return false;
+  }
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps < 0) {
+    return true; // the addresses just stay unsymbolized
+  }
+  char buf[4096];
+  ssize_t n;
+  bool ok = true;
+  while (ok && ((n = read(maps, buf, sizeof(buf))) > 0 ||
+                (n < 0 && errno == EINTR))) {
+    ok = n < 0 || write_all(fd, buf, (size_t)n);
+  }
+  close(maps);
+  return ok;
+}
+
+/* tinymalloc_profile_dump */
+int tinymalloc_profile_dump(int fd) {
+  // anything stdio allocates while the lock is held mustn't be sampled
+  int64_t countdown = sample_countdown;
+  sample_countdown = INT64_MAX;
+  pthread_mutex_lock(&samples_lock);
+  bool ok = profile_write(fd);
+  pthread_mutex_unlock(&samples_lock);
+  sample_countdown = countdown;
+  return ok ? 0 : -1;
+}
+
+/* allocate */
+// serves a request from slabs, the block heap or a mapping of its own
+// depending on its size, aligned to alignment and zeroed if zero is set.
+// fresh mappings are zero already, so large requests are never cleared.
+// it's also where the heap profiler's countdown runs
+static void *allocate(size_t size, size_t alignment, bool zero) {
+  if ((sample_countdown -= (int64_t)size) < 0) {
+    void *ptr = profile_alloc(size, alignment, zero);
+    if (ptr) {
+      return ptr;
+    }
+  }
+
+  if (size <= SLAB_MAX) {
+    size_t class_idx = slab_class_for(size, alignment);
+    void *ptr = class_idx < NUM_SLAB_CLASSES ? small_alloc(class_idx) : NULL;
+    if (ptr) {
+      if (zero) {
+        memset(ptr, 0, size);
+      }
+      return ptr;
+    }
+  }
+
+  size_t threshold =
+      atomic_load_explicit(&large_threshold, memory_order_relaxed);
+  if (size >= threshold || alignment >= threshold - size) {
+    return large_alloc(size, alignment);
+  }
+  return block_alloc(size, alignment, zero);
+}
+
+static void free_object(void *ptr);
+
+#ifdef TINYMALLOC_DEBUG
+/* debug_fail */
+static void debug_fail(const char *what, void *ptr) {
+  char line[128];
+  int len = snprintf(line, sizeof(line), "tinymalloc: %s of %p\n", what, ptr);
+  write_all(STDERR_FILENO, line, (size_t)len);
+  abort();
+}
+
+/* debug_header */
+static debug_header_t *debug_header(void *ptr) {
+  return ((debug_header_t *)ptr) - 1;
+}
+
+/* debug_canary */
+static uint32_t debug_canary(void *ptr, uint32_t state) {
+  return state ^ (uint32_t)((uintptr_t)ptr >> 4);
+}
+
+/* debug_shard */
+static debug_shard_t *debug_shard(void *ptr) {
+  uintptr_t addr = (uintptr_t)ptr;
+  return &debug_shards[((addr >> 4) ^ (addr >> 12)) & (DEBUG_SHARDS - 1)];
+}
+
+/* debug_released */
+// tells whether the allocator itself has an object as free. objects held
+// by a thread cache still look allocated here, their header tells
+static bool debug_released(void *raw) {
+  if (is_slab_ptr(raw)) {
+    slab_t *slab = ptr_to_slab(raw);
+    size_t slot = (size_t)((char *)raw - ((char *)slab + SLAB_DATA_OFFSET)) /
+                  slab->object_size;
+    slab_bin_t *bin = &slab->arena->slab_bins[slab->class_idx];
+    pthread_mutex_lock(&bin->lock);
+    bool clear = !(slab->bitmap[slot / 64] & (1ULL << (slot % 64)));
+    pthread_mutex_unlock(&bin->lock);
+    return clear;
+  }
+
+  memory_block_t *block = ((memory_block_t *)raw) - 1;
+  if (block_arena(block) == ARENA_LARGE) {
+    return false; // unmapped as soon as it's freed
+  }
+  arena_t *arena = &arenas[block_arena(block)];
+  arena_lock(arena);
+  bool free = !block_in_use(block);
+  arena_unlock(arena);
+  return free;
+}
+
+/* debug_check */
+// returns the header of a live allocation, failing on anything else
+static debug_header_t *debug_check(void *ptr) {
+  if (!is_owned(ptr)) {
+    debug_fail("free or lookup of memory it doesn't own", ptr);
+  }
+  debug_header_t *header = debug_header(ptr);
+  if (header->canary == debug_canary(ptr, DEBUG_FREED) ||
+      debug_released((char *)ptr - header->offset)) {
+    debug_fail("double free", ptr);
+  }
+  if (header->canary != debug_canary(ptr, DEBUG_LIVE) ||
+      header->offset + header->size + DEBUG_TAIL_BYTES >
+          usable_size((char *)ptr - header->offset)) {
+    debug_fail("invalid pointer or overwritten header", ptr);
+  }
+
+  uint64_t tail;
+  memcpy(&tail, (char *)ptr + header->size, sizeof(tail));
+  if (tail != DEBUG_TAIL) {
+    debug_fail("overflow past the end", ptr);
+  }
+  return header;
+}
+
+/* debug_link */
+static void debug_link(debug_header_t *header) {
+  debug_shard_t *shard = debug_shard(header + 1);
+  pthread_mutex_lock(&shard->lock);
+  header->prev = NULL;
+  header->next = shard->live;
+  if (shard->live) {
+    shard->live->prev = header;
+  }
+  shard->live = header;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* debug_unlink */
+static void debug_unlink(debug_header_t *header) {
+  debug_shard_t *shard = debug_shard(header + 1);
+  pthread_mutex_lock(&shard->lock);
+  if (header->prev) {
+    header->prev->next = header->next;
+  } else {
+    shard->live = header->next;
+  }
+  if (header->next) {
+    header->next->prev = header->prev;
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* debug_wrap */
+// writes the header and tail canary of a live allocation and links it
+static void debug_wrap(char *ptr, size_t size, size_t offset) {
+  debug_header_t *header = debug_header(ptr);
+  header->size = size;
+  header->offset = (uint32_t)offset;
+  header->canary = debug_canary(ptr, DEBUG_LIVE);
+  uint64_t tail = DEBUG_TAIL;
+  memcpy(ptr + size, &tail, sizeof(tail));
+  debug_link(header);
+}
+
+/* debug_alloc */
+// the header takes as many bytes as the alignment, at least its size
+static void *debug_alloc(size_t size, size_t alignment, bool zero) {
+  pthread_once(&init_once, global_init);
+  size_t offset = alignment > sizeof(debug_header_t) ? alignment
+                                                     : sizeof(debug_header_t);
+  if (offset > UINT32_MAX || size > SIZE_MAX / 2) {
+    return NULL;
+  }
+
+  char *raw = allocate(offset + size + DEBUG_TAIL_BYTES, alignment, zero);
+  if (raw == NULL) {
+    return NULL;
+  }
+  debug_wrap(raw + offset, size, offset);
+  return raw + offset;
+}
+
+/* quarantine_release */
+// frees the oldest object of the quarantine, whose poison must be intact
+static void quarantine_release(quarantine_t *q) {
+  void *ptr = q->slots[q->head];
+  q->head = (q->head + 1) % DEBUG_QUARANTINE_SLOTS;
+  q->count--;
+
+  debug_header_t *header = debug_header(ptr);
+  size_t poisoned = header->size < DEBUG_POISON_MAX ? header->size
+                                                    : DEBUG_POISON_MAX;
+  for (size_t i = 0; i < poisoned; i++) {
+    if (((unsigned char *)ptr)[i] != DEBUG_POISON) {
+      debug_fail("write after free", ptr);
+    }
+  }
+  q->bytes -= header->size;
+  free_object((char *)ptr - header->offset);
+}
+
+/* quarantine_flush */
+// frees everything an exiting thread's quarantine holds
+static void quarantine_flush() {
+  quarantine_t *q = quarantine;
+  if (q == NULL) {
+    return;
+  }
+  quarantine = NULL;
+  while (q->count > 0) {
+    quarantine_release(q);
+  }
+  os_unmap(q, sizeof(quarantine_t));
+}
+
+/* debug_free */
+static void debug_free(void *ptr) {
+  debug_header_t *header = debug_check(ptr);
+  debug_unlink(header);
+  header->canary = debug_canary(ptr, DEBUG_FREED);
+  size_t size = header->size;
+  memset(ptr, DEBUG_POISON, size < DEBUG_POISON_MAX ? size : DEBUG_POISON_MAX);
+
+  // the quarantine is mapped on the thread's first free, once its exit
+  // is sure to flush it. a thread without a cache, because it has no key
+  // or thread_teardown already ran, frees right away: nothing would flush
+  quarantine_t *q = quarantine;
+  if (q == NULL && size <= DEBUG_QUARANTINE_BYTES) {
+    choose_arena();
+    if (tcache.state == TCACHE_ACTIVE) {
+      q = os_map(sizeof(quarantine_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS);
+      q = quarantine = q == MAP_FAILED ? NULL : q;
+    }
+  }
+  if (q == NULL || size > DEBUG_QUARANTINE_BYTES) {
+    free_object((char *)ptr - header->offset);
+    return;
+  }
+
+  while (q->count == DEBUG_QUARANTINE_SLOTS ||
+         q->bytes + size > DEBUG_QUARANTINE_BYTES) {
+    quarantine_release(q);
+  }
+  q->slots[(q->head + q->count) % DEBUG_QUARANTINE_SLOTS] = ptr;
+  q->count++;
+  q->bytes += size;
+}
+#endif
+
+/* allocate_user */
+// allocate, wrapped for checking in debug builds
+static void *allocate_user(size_t size, size_t alignment, bool zero) {
+#ifdef TINYMALLOC_DEBUG
+  return debug_alloc(size, alignment, zero);
+#else
+  return allocate(size, alignment, zero);
+#endif
+}
+
+/* free_user */
+// free_object, checked and quarantined in debug builds
+static void free_user(void *ptr) {
+#ifdef TINYMALLOC_DEBUG
+  debug_free(ptr);
+#else
+  free_object(ptr);
+#endif
+}
+
+/* tinymalloc_leak_dump */
+size_t tinymalloc_leak_dump(int fd) {
+#ifdef TINYMALLOC_DEBUG
+  size_t leaks = 0, bytes = 0;
+  for (size_t i = 0; i < DEBUG_SHARDS; i++) {
+    pthread_mutex_lock(&debug_shards[i].lock);
+    for (debug_header_t *header = debug_shards[i].live; header;
+         header = header->next) {
+      char line[96];
+      int len = snprintf(line, sizeof(line), "tinymalloc: leaked %zu bytes at %p\n",
+                         header->size, (void *)(header + 1));
+      write_all(fd, line, (size_t)len);
+      leaks++;
+      bytes += header->size;
+    }
+    pthread_mutex_unlock(&debug_shards[i].lock);
+  }
+  if (leaks > 0) {
+    char line[96];
+    int len = snprintf(line, sizeof(line), "tinymalloc: %zu leaks, %zu bytes\n",
+                       leaks, bytes);
+    write_all(fd, line, (size_t)len);
+  }
+  return leaks;
+#else
+  (void)fd;
+  return 0;
+#endif
+}
 
-static memory_block_t *heap_head = NULL;
-pthread_mutex_t malloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+#if defined(TINYMALLOC_DEBUG) && defined(__GNUC__)
+/* report_leaks */
+__attribute__((destructor)) static void report_leaks() {
+  tinymalloc_leak_dump(STDERR_FILENO);
+}
+#endif
 
 /* tinymalloc */
 void *tinymalloc(size_t size) {
-  pthread_mutex_lock(&malloc_mutex);
+  // v0.1 returns NULL, but in the future it should return a
+  // non-NULL pointer that can be valid for tinyfree.
+  // sizes that would overflow once aligned are rejected as well
+  if (size == 0 || size > SIZE_MAX - sizeof(memory_block_t) - ALIGNMENT) {
+    return NULL;
+  }
+
+  // small requests are served from slabs. if no slab can be had, they
+  // take the block path like everything else
+  void *ptr = allocate_user(size, ALIGNMENT, false);
+  if (ptr) {
+    TM_TRACE(MALLOC, ptr, size, 0);
+  }
+  return ptr;
+}
+
+/* tinycalloc */
+void *tinycalloc(size_t nmemb, size_t size) {
+  // products that overflow are rejected here, once
+  if (size != 0 && nmemb > SIZE_MAX / size) {
+    return NULL;
+  }
+  size_t total = nmemb * size;
+  if (total == 0 || total > SIZE_MAX - sizeof(memory_block_t) - ALIGNMENT) {
+    return NULL;
+  }
+
+  void *ptr = allocate_user(total, ALIGNMENT, true);
+  if (ptr) {
+    TM_TRACE(CALLOC, ptr, total, 0);
+  }
+  return ptr;
+}
 
-  printf("DEBUG - entered tinymalloc.\n");
+/* tiny_aligned_alloc */
+void *tiny_aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  // alignments and sizes are bounded so their sums can't overflow
+  if (size == 0 || size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+    return NULL;
+  }
 
-  // align the size
-  // we ensure that the requested size is algined to a multiple of
-  // sizeof(size_t)
-  size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if (alignment < ALIGNMENT) {
+    alignment = ALIGNMENT;
+  }
+  void *ptr = allocate_user(size, alignment, false);
+  if (ptr) {
+    TM_TRACE(MALLOC, ptr, size, alignment);
+  }
+  return ptr;
+}
 
-  printf("DEBUG - size aligned: %zu\n", size);
+/* tiny_posix_memalign */
+int tiny_posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+      alignment % sizeof(void *) != 0) {
+    return EINVAL;
+  }
 
-  // v0.1 returns NULL, but in the future it should return a
-  // non-NULL pointer that can be valid for tinyfree
+  *memptr = NULL;
+  if (size == 0) {
+    return 0;
+  }
+  void *ptr = tiny_aligned_alloc(alignment, size);
+  if (ptr == NULL) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+/* stat_free */
+// counts the free of a slab object or block that isn't cached
+static void stat_free(void *ptr, bool in_slab) {
+  if (in_slab) {
+    stat_add(STAT_FREES + ptr_to_slab(ptr)->class_idx, 1);
+  } else {
+    stat_add(STAT_FREES + STAT_HEAP_CLASS, 1);
+    stat_sub(STAT_HEAP_BYTES,
+             block_tag(((memory_block_t *)ptr) - 1) & TAG_SIZE_MASK);
+  }
+}
+
+/* release */
+// frees what the thread cache didn't take
+static void release(void *ptr, bool in_slab) {
+  memory_block_t *block = ((memory_block_t *)ptr) - 1;
+  if (!in_slab && is_sampled(ptr)) {
+    profile_free(ptr);
+  }
+  if (!in_slab && block_arena(block) == ARENA_LARGE) {
+    large_free(block);
+    return;
+  }
+  stat_free(ptr, in_slab);
+
+  // the memory goes back to the arena owning it. if that isn't the
+  // caller's one, it's queued there rather than taking a foreign lock
+  arena_t *arena =
+      in_slab ? ptr_to_slab(ptr)->arena : &arenas[block_arena(block)];
+  if (arena != choose_arena()) {
+    remote_free(arena, ptr, ptr, 1);
+    return;
+  }
+
+  pthread_mutex_t *lock = object_lock(arena, ptr);
+  lock_counted(arena, lock);
+  free_locked(arena, ptr);
+  pthread_mutex_unlock(lock);
+}
+
+/* node_local */
+// tells whether a slab object belongs to the node the caller runs on. the
+// part of the region it lies in gives its node, without reading its slab
+static bool node_local(void *ptr) {
+  if (numa_nodes <= 1) {
+    return true;
+  }
+  uintptr_t offset = (uintptr_t)ptr - (uintptr_t)atomic_load_explicit(
+                                          &slab_region, memory_order_relaxed);
+  return (offset >> slab_part_shift) == choose_arena()->node;
+}
+
+/* tinymalloc_usable_size */
+size_t tinymalloc_usable_size(void *ptr) {
+#ifdef TINYMALLOC_DEBUG
+  return ptr ? debug_check(ptr)->size : 0;
+#else
+  return ptr && is_owned(ptr) ? usable_size(ptr) : 0;
+#endif
+}
+
+/* tinymalloc_owns */
+int tinymalloc_owns(const void *ptr) { return ptr && is_owned(ptr); }
+
+/* free_object */
+static void free_object(void *ptr) {
+  // objects of another node's arena skip the cache, so they go back to
+  // their node rather than being reused here
+  bool in_slab = is_slab_ptr(ptr);
+  if (in_slab && node_local(ptr) &&
+      tcache_free(ptr, ptr_to_slab(ptr)->class_idx, true)) {
+    return;
+  }
+  // memory tinymalloc doesn't own is left alone
+  if (!in_slab && pagemap_get(ptr) == PAGE_FOREIGN) {
+    return;
+  }
+  release(ptr, in_slab);
+}
+
+/* tinyfree */
+void tinyfree(void *ptr) {
+  if (!ptr)
+    return;
+
+  TM_TRACE(FREE, ptr, 0, 0);
+  free_user(ptr);
+}
+
+/* tinyfree_sized */
+// the size class of a slab object follows from its size, and its node from
+// its address, so it goes to the thread cache without reading its slab
+// descriptor. as in free_object, another node's objects skip the cache.
+// everything else is freed as by tinyfree
+void tinyfree_sized(void *ptr, size_t size) {
+  if (!ptr)
+    return;
+
+  TM_TRACE(FREE, ptr, size, 0);
+
+#ifdef TINYMALLOC_DEBUG
+  if (size != 0 && size != debug_check(ptr)->size) {
+    debug_fail("sized free with the wrong size", ptr);
+  }
+  debug_free(ptr);
+  return;
+#endif
+
+  bool in_slab = is_slab_ptr(ptr);
+  if (in_slab && size != 0 && size <= SLAB_MAX &&
+      node_local(ptr) && tcache_free(ptr, size_to_slab_class(size), true)) {
+    return;
+  }
+  if (!in_slab && pagemap_get(ptr) == PAGE_FOREIGN) {
+    return;
+  }
+  release(ptr, in_slab);
+}
+
+/* resize_in_place */
+// a slab object whose class still fits the new size stays where it is, a
+// block shrinks or absorbs its free successor, and a large allocation that
+// stays large is remapped. returns NULL if none of it applies
+static void *resize_in_place(void *ptr, size_t size) {
+  if (is_slab_ptr(ptr)) {
+    if (size <= SLAB_MAX &&
+        size_to_slab_class(size) == ptr_to_slab(ptr)->class_idx) {
+      return ptr;
+    }
+  } else if (is_sampled(ptr)) {
+    // samples are moved, so the profiler never has a stale address or size
+  } else if (block_arena(((memory_block_t *)ptr) - 1) == ARENA_LARGE) {
+    if (size >= atomic_load_explicit(&large_threshold, memory_order_relaxed)) {
+      return large_resize(ptr, size);
+    }
+  } else if (size < atomic_load_explicit(&large_threshold,
+                                         memory_order_relaxed) &&
+             resize_block(((memory_block_t *)ptr) - 1,
+                          request_to_block_size(size))) {
+    return ptr;
+  }
+  return NULL;
+}
+
+/* tinyrealloc */
+// resizes in place whenever it can, only otherwise is the memory copied
+// to a new allocation. in debug builds the wrapped allocation is resized,
+// its header relinked wherever it ends up
+void *tinyrealloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return tinymalloc(size);
+  }
   if (size == 0) {
-    pthread_mutex_unlock(&malloc_mutex);
+    tinyfree(ptr);
+    return NULL;
+  }
+  if (size > SIZE_MAX - sizeof(memory_block_t) - ALIGNMENT) {
+    return NULL;
+  }
+
+#ifdef TINYMALLOC_DEBUG
+  debug_header_t *header = debug_check(ptr);
+  size_t offset = header->offset;
+  debug_unlink(header);
+  char *raw = size > SIZE_MAX / 2
+                  ? NULL
+                  : resize_in_place((char *)ptr - offset,
+                                    offset + size + DEBUG_TAIL_BYTES);
+  if (raw) {
+    void *resized = raw + offset;
+    debug_wrap(resized, size, offset);
+    TM_TRACE(REALLOC, resized, size, ptr);
+    return resized;
+  }
+  debug_link(header);
+#else
+  if (!is_owned(ptr)) {
+    errno = EINVAL;
     return NULL;
   }
+  void *resized = resize_in_place(ptr, size);
+  if (resized) {
+    TM_TRACE(REALLOC, resized, size, ptr);
+    return resized;
+  }
+#endif
 
-  if (heap_head == NULL) {
-    printf("DEBUG - heap non-existent. we start the initialization.\n");
+  void *moved = tinymalloc(size);
+  if (moved == NULL) {
+    return NULL;
+  }
+  size_t old_size = tinymalloc_usable_size(ptr);
+  memcpy(moved, ptr, old_size < size ? old_size : size);
+  tinyfree(ptr);
+  TM_TRACE(REALLOC, moved, size, ptr);
+  return moved;
+}
 
-    // we initialize the heap
-    heap_head = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (heap_head == MAP_FAILED) {
-      pthread_mutex_unlock(&malloc_mutex);
-      return false;
+/* batch_alloc */
+// the thread cache hands over a whole run of objects first, whatever it
+// can't provide comes from the caller's arena under a single lock
+static size_t batch_alloc(size_t size, size_t n, void **out) {
+  size_t done = 0;
+  if (size >= atomic_load_explicit(&large_threshold, memory_order_relaxed)) {
+    while (done < n && (out[done] = large_alloc(size, ALIGNMENT))) {
+      done++;
+    }
+  } else {
+    arena_t *arena = choose_arena();
+    size_t class_idx = size <= SLAB_MAX ? size_to_slab_class(size) : 0;
+    if (size <= SLAB_MAX) {
+      done = tcache_take(class_idx, out, n);
+      stat_add(STAT_ALLOCS + class_idx, done);
+      stat_add(STAT_TCACHE_HITS, done);
+    }
+
+    if (done < n && size <= SLAB_MAX) {
+      slab_bin_t *slabs = &arena->slab_bins[class_idx];
+      size_t cached = done;
+      lock_counted(arena, &slabs->lock);
+      arena_drain_remote(arena, &slabs->remote);
+      while (done < n && (out[done] = slab_alloc(arena, class_idx))) {
+        done++;
+      }
+      pthread_mutex_unlock(&slabs->lock);
+      stat_add(STAT_ALLOCS + class_idx, done - cached);
     }
 
-    heap_head->size = HEAP_SIZE - sizeof(memory_block_t);
-    heap_head->next = NULL;
-    heap_head->prev = NULL;
-    heap_head->is_free = 1;
+    // what the slabs couldn't serve comes from the block heap
+    if (done < n) {
+      arena_lock(arena);
+      arena_drain_remote(arena, &arena->remote);
+      memory_block_t *block;
+      while (done < n && (block = take_block(arena, size, ALIGNMENT))) {
+        out[done++] = block + 1;
+        stat_add(STAT_ALLOCS + STAT_HEAP_CLASS, 1);
+        stat_add(STAT_HEAP_BYTES, block_size(block));
+      }
+      arena_unlock(arena);
+    }
+  }
+  return done;
+}
 
-    printf("DEBUG - heap now exists.\n");
+/* tinymalloc_batch */
+// objects the profiler's countdown covers are charged to it and allocated
+// in bulk, the one it runs out on goes through allocate to be sampled
+size_t tinymalloc_batch(size_t size, size_t n, void **out) {
+  if (size == 0 || size > SIZE_MAX - sizeof(memory_block_t) - ALIGNMENT) {
+    return 0;
   }
 
-  // first-fit search
-  memory_block_t *current = heap_head;
+#ifdef TINYMALLOC_DEBUG
+  // every object is wrapped on its own
+  size_t wrapped = 0;
+  while (wrapped < n && (out[wrapped] = tinymalloc(size))) {
+    wrapped++;
+  }
+  return wrapped;
+#endif
 
-  printf("DEBUG - we start the first-fit search.\n");
+  size_t done = 0;
+  while (done < n) {
+    size_t covered = sample_countdown > 0 ? (size_t)sample_countdown / size : 0;
+    if (covered > n - done) {
+      covered = n - done;
+    }
+    size_t got = batch_alloc(size, covered, out + done);
+    sample_countdown -= (int64_t)(got * size);
+    done += got;
+    if (got < covered || done == n ||
+        (out[done] = allocate(size, ALIGNMENT, false)) == NULL) {
+      break;
+    }
+    done++;
+  }
 
-  memory_block_t *last_block = current->prev;
+  for (size_t i = 0; i < done; i++) {
+    TM_TRACE(MALLOC, out[i], size, 0);
+  }
+  return done;
+}
 
-  while (current) {
-    last_block = current;
-    if (current->is_free && current->size >= size) {
-      printf("DEBUG - block found. we try to split it, if possible.\n");
-      // split if possible
-      if (current->size >= size + sizeof(memory_block_t) + ALIGNMENT) {
-        printf(
-            "DEBUG - split is possible, so we proceed.\n"); // i have to
-                                                            // carefully review
-                                                            // this path because
-                                                            // it always goes
-                                                            // here!
+/* tinyfree_batch */
+// slab objects fill the thread cache as long as it has room, everything
+// else is freed in one batch: a single lock for the caller's arena, one
+// queue push per run of objects owned by another
+void tinyfree_batch(void **ptrs, size_t n) {
+#ifdef TINYMALLOC_DEBUG
+  for (size_t i = 0; i < n; i++) {
+    tinyfree(ptrs[i]);
+  }
+  return;
+#endif
 
-        memory_block_t *new_block =
-            (memory_block_t *)((char *)current + sizeof(memory_block_t) + size);
-        new_block->size = current->size - size - sizeof(memory_block_t);
-        new_block->is_free = 1;
-        new_block->next = current->next;
-        new_block->prev = current;
+  free_batch_t batch = {.current = choose_arena()};
+  for (size_t i = 0; i < n; i++) {
+    void *ptr = ptrs[i];
+    if (!ptr) {
+      continue;
+    }
+    TM_TRACE(FREE, ptr, 0, 0);
 
-        if (current->next) {
-          current->next->prev = new_block;
-        }
-        current->size = size;
-        current->next = new_block;
+    if (is_slab_ptr(ptr)) {
+      slab_t *slab = ptr_to_slab(ptr);
+      if (!tcache_free(ptr, slab->class_idx, false)) {
+        stat_free(ptr, true);
+        free_batch_add(&batch, slab->arena, ptr);
       }
+      continue;
+    }
+
+    if (pagemap_get(ptr) == PAGE_FOREIGN) {
+      continue;
+    }
+    memory_block_t *block = ((memory_block_t *)ptr) - 1;
+    if (is_sampled(ptr)) {
+      profile_free(ptr);
+    }
+    if (block_arena(block) == ARENA_LARGE) {
+      large_free(block);
+    } else {
+      stat_free(ptr, false);
+      free_batch_add(&batch, &arenas[block_arena(block)], ptr);
+    }
+  }
+  free_batch_finish(&batch);
+}
+
+/* tiny_arena_create */
+// chunks start at chunk_size bytes, REGION_INITIAL_CHUNK if it's 0, and
+// double up to REGION_MAX_CHUNK as the region grows
+tiny_arena_t *tiny_arena_create(size_t chunk_size) {
+  if (chunk_size > SIZE_MAX / 4) {
+    return NULL;
+  }
+
+  tiny_arena_t *region = tinymalloc(sizeof(tiny_arena_t));
+  if (region == NULL) {
+    return NULL;
+  }
+
+  region->chunks = NULL;
+  region->current = NULL;
+  region->oversized = NULL;
+  region->cursor = NULL;
+  region->end = NULL;
+  region->chunk_size = chunk_size ? chunk_size : REGION_INITIAL_CHUNK;
+  return region;
+}
 
-      printf("DEBUG - split is not possible. we take current block as-is.\n");
+/* region_chunk_data */
+static char *region_chunk_data(region_chunk_t *chunk) {
+  return (char *)chunk + REGION_CHUNK_HEADER;
+}
 
-      current->is_free = 0;
-      current->size = size;
+/* region_use_chunk */
+static void region_use_chunk(tiny_arena_t *region, region_chunk_t *chunk) {
+  region->current = chunk;
+  region->cursor = region_chunk_data(chunk);
+  region->end = region->cursor + chunk->size;
+}
 
-      printf("DEBUG - we prepare to unlock mutex\n");
-      pthread_mutex_unlock(&malloc_mutex);
-      printf("DEBUG - mutex unlocked. we return.\n");
-      return (void *)(current + 1);
+/* region_refill */
+// serves an aligned size that doesn't fit the current chunk: from a chunk
+// kept from before the last reset, a new chunk, or a chunk of its own if
+// it's more than a quarter of a regular one. kept chunks too small for size
+// are older than the last doubling, they're freed for a new regular chunk
+static void *region_refill(tiny_arena_t *region, size_t size) {
+  if (size > region->chunk_size / 4) {
+    if (size > SIZE_MAX - REGION_CHUNK_HEADER) {
+      return NULL;
+    }
+    region_chunk_t *chunk = tinymalloc(REGION_CHUNK_HEADER + size);
+    if (chunk == NULL) {
+      return NULL;
     }
-    current = current->next;
+    chunk->size = size;
+    chunk->next = region->oversized;
+    region->oversized = chunk;
+    return region_chunk_data(chunk);
+  }
+
+  region_chunk_t **link =
+      region->current ? &region->current->next : &region->chunks;
+  while (*link && (*link)->size < size) {
+    region_chunk_t *small = *link;
+    *link = small->next;
+    tinyfree(small);
   }
 
-  if (last_block != NULL) {
-    size_t block_size = size + sizeof(memory_block_t);
-    memory_block_t *more_memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (more_memory == MAP_FAILED) {
-      pthread_mutex_unlock(&malloc_mutex);
-      return NULL; // OOM
+  region_chunk_t *next = *link;
+  if (next == NULL) {
+    next = tinymalloc(REGION_CHUNK_HEADER + region->chunk_size);
+    if (next == NULL) {
+      return NULL;
     }
+    next->size = region->chunk_size;
+    next->next = NULL;
+    *link = next;
+    if (region->chunk_size < REGION_MAX_CHUNK) {
+      region->chunk_size *= 2;
+    }
+  }
+
+  region_use_chunk(region, next);
+  void *ptr = region->cursor;
+  region->cursor += size;
+  return ptr;
+}
 
-    more_memory->size = size;
-    more_memory->is_free = 0;
-    more_memory->next = NULL;
-    more_memory->prev = last_block;
+/* tiny_arena_alloc */
+void *tiny_arena_alloc(tiny_arena_t *region, size_t size) {
+  if (size == 0 || size > SIZE_MAX - ALIGNMENT) {
+    return NULL;
+  }
 
-    last_block->next = more_memory;
-    printf("DEBUG - we prepare to unlock mutex\n");
-    pthread_mutex_unlock(&malloc_mutex);
-    printf("DEBUG - mutex unlocked. we return newly allocated memory.\n");
-    return (void *)(more_memory + 1);
+  size_t aligned = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  if ((size_t)(region->end - region->cursor) >= aligned) {
+    void *ptr = region->cursor;
+    region->cursor += aligned;
+    return ptr;
   }
+  return region_refill(region, aligned);
+}
 
-  printf("DEBUG - we prepare to unlock mutex\n");
-  pthread_mutex_unlock(&malloc_mutex);
-  printf("DEBUG - mutex unlocked. we exit. out-of-memory or unexpected error "
-         "occurred.\n");
-  return NULL; // OOM
+/* region_free_oversized */
+static void region_free_oversized(tiny_arena_t *region) {
+  while (region->oversized) {
+    region_chunk_t *next = region->oversized->next;
+    tinyfree(region->oversized);
+    region->oversized = next;
+  }
 }
 
-/* tinyfree */
-void tinyfree(void *ptr) {
-  if (!ptr)
+/* tiny_arena_reset */
+// rewinds to the first chunk. only oversized chunks are freed, so this
+// doesn't depend on how many objects were allocated
+void tiny_arena_reset(tiny_arena_t *region) {
+  region_free_oversized(region);
+  if (region->chunks) {
+    region_use_chunk(region, region->chunks);
+  }
+}
+
+/* tiny_arena_destroy */
+void tiny_arena_destroy(tiny_arena_t *region) {
+  if (region == NULL) {
     return;
+  }
 
-  printf("DEBUG - entered tinyfree. preparing to lock mutex\n");
-  pthread_mutex_lock(&malloc_mutex);
-  printf("DEBUG - mutex locked, we continue \n");
-  memory_block_t *block = ((memory_block_t *)ptr) - 1;
-  block->is_free = 1;
+  region_free_oversized(region);
+  while (region->chunks) {
+    region_chunk_t *next = region->chunks->next;
+    tinyfree(region->chunks);
+    region->chunks = next;
+  }
+  tinyfree(region);
+}
+
+/* tiny_pool_create */
+// slots are obj_size bytes rounded up to a multiple of align, a power of
+// two. each has room for the free-list link
+tiny_pool_t *tiny_pool_create(size_t obj_size, size_t align) {
+  if (align == 0 || (align & (align - 1)) != 0 || obj_size == 0 ||
+      obj_size > POOL_CHUNK_SIZE / 4 || align > POOL_CHUNK_SIZE / 4) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  tiny_pool_t *pool = tinymalloc(sizeof(tiny_pool_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+  size_t slot_size = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->free_list = NULL;
+  pool->cursor = NULL;
+  pool->end = NULL;
+  pool->chunks = NULL;
+  pool->slot_size = (slot_size + align - 1) & ~(align - 1);
+  pool->align = align;
+  atomic_init(&pool->magazine_depth, 0);
+
+  pthread_mutex_lock(&pools_lock);
+  pool->generation = ++pool_generation;
+  pool->next = pools;
+  pools = pool;
+  pthread_mutex_unlock(&pools_lock);
+  return pool;
+}
 
-  // coalesce with next block
-  if (block->next && block->next->is_free) {
-    printf("DEBUG - we coalesce with next block\n");
-    block->size += sizeof(memory_block_t) + block->next->size;
-    block->next = block->next->next;
-    if (block->next) {
-      block->next->prev = block;
+/* tiny_pool_set_magazine */
+int tiny_pool_set_magazine(tiny_pool_t *pool, unsigned int depth) {
+  if (depth > POOL_MAX_MAGAZINE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  atomic_store(&pool->magazine_depth, depth);
+  return 0;
+}
+
+/* pool_take */
+// pops a free slot, or carves one from the newest chunk, getting a new
+// chunk if it's used up. the caller holds the pool's lock
+static void *pool_take(tiny_pool_t *pool) {
+  void *ptr = pool->free_list;
+  if (ptr) {
+    pool->free_list = *(void **)ptr;
+    return ptr;
+  }
+
+  if ((size_t)(pool->end - pool->cursor) < pool->slot_size) {
+    region_chunk_t *chunk =
+        pool->align > ALIGNMENT
+            ? tiny_aligned_alloc(pool->align, POOL_CHUNK_SIZE)
+            : tinymalloc(POOL_CHUNK_SIZE);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->size = POOL_CHUNK_SIZE;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    size_t header =
+        (REGION_CHUNK_HEADER + pool->align - 1) & ~(pool->align - 1);
+    pool->cursor = (char *)chunk + header;
+    pool->end = (char *)chunk + POOL_CHUNK_SIZE;
+  }
+
+  ptr = pool->cursor;
+  pool->cursor += pool->slot_size;
+  return ptr;
+}
+
+/* pool_put_chain */
+// pushes a chain of slots on the free list. the caller holds the lock
+static void pool_put_chain(tiny_pool_t *pool, void *first, void *last) {
+  *(void **)last = pool->free_list;
+  pool->free_list = first;
+}
+
+/* pool_is_live */
+// tells whether a magazine still belongs to a live pool. the caller holds
+// pools_lock
+static bool pool_is_live(pool_magazine_t *magazine) {
+  for (tiny_pool_t *pool = pools; pool; pool = pool->next) {
+    if (pool == magazine->pool && pool->generation == magazine->generation) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* pool_magazine */
+// returns the calling thread's magazine of a pool, claiming a slot for it
+// if it has none. a slot is free if it's empty or its pool is gone. returns
+// NULL if every slot holds objects of another live pool
+static pool_magazine_t *pool_magazine(tiny_pool_t *pool) {
+  // magazines are given back by the thread teardown, so a thread that
+  // won't have one gets none
+  if (tcache.state != TCACHE_ACTIVE) {
+    if (tcache.state == TCACHE_DISABLED) {
+      return NULL;
+    }
+    thread_setup();
+    if (tcache.state != TCACHE_ACTIVE) {
+      return NULL;
+    }
+  }
+
+  pool_magazine_t *free_slot = NULL;
+  for (size_t i = 0; i < POOL_MAGAZINE_SLOTS; i++) {
+    pool_magazine_t *magazine = &pool_magazines[i];
+    if (magazine->pool == pool) {
+      if (magazine->generation == pool->generation) {
+        return magazine;
+      }
+      magazine->count = 0; // left over by a destroyed pool
+      magazine->head = NULL;
+    }
+    if (free_slot == NULL && magazine->count == 0) {
+      free_slot = magazine;
+    }
+  }
+
+  if (free_slot == NULL) {
+    pthread_mutex_lock(&pools_lock);
+    for (size_t i = 0; i < POOL_MAGAZINE_SLOTS && !free_slot; i++) {
+      if (!pool_is_live(&pool_magazines[i])) {
+        free_slot = &pool_magazines[i];
+      }
+    }
+    pthread_mutex_unlock(&pools_lock);
+    if (free_slot == NULL) {
+      return NULL;
+    }
+  }
+
+  free_slot->pool = pool;
+  free_slot->generation = pool->generation;
+  free_slot->head = NULL;
+  free_slot->count = 0;
+  return free_slot;
+}
+
+/* tiny_pool_alloc */
+void *tiny_pool_alloc(tiny_pool_t *pool) {
+  unsigned int depth =
+      atomic_load_explicit(&pool->magazine_depth, memory_order_relaxed);
+  pool_magazine_t *magazine = depth ? pool_magazine(pool) : NULL;
+  if (magazine == NULL) {
+    pthread_mutex_lock(&pool->lock);
+    void *ptr = pool_take(pool);
+    pthread_mutex_unlock(&pool->lock);
+    return ptr;
+  }
+
+  // an empty magazine is refilled with half its depth in one locked go
+  if (magazine->head == NULL) {
+    uint32_t batch = depth > 1 ? depth / 2 : 1;
+    pthread_mutex_lock(&pool->lock);
+    while (magazine->count < batch) {
+      void *ptr = pool_take(pool);
+      if (ptr == NULL) {
+        break;
+      }
+      *(void **)ptr = magazine->head;
+      magazine->head = ptr;
+      magazine->count++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (magazine->head == NULL) {
+      return NULL;
+    }
+  }
+
+  void *ptr = magazine->head;
+  magazine->head = *(void **)ptr;
+  magazine->count--;
+  return ptr;
+}
+
+/* tiny_pool_free */
+void tiny_pool_free(tiny_pool_t *pool, void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  unsigned int depth =
+      atomic_load_explicit(&pool->magazine_depth, memory_order_relaxed);
+  pool_magazine_t *magazine = depth ? pool_magazine(pool) : NULL;
+  if (magazine == NULL) {
+    pthread_mutex_lock(&pool->lock);
+    pool_put_chain(pool, ptr, ptr);
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  // a full magazine gives half of it back first
+  if (magazine->count >= depth) {
+    void *first = magazine->head;
+    void *last = first;
+    uint32_t n = magazine->count - depth / 2;
+    for (uint32_t i = 1; i < n; i++) {
+      last = *(void **)last;
+    }
+    magazine->head = *(void **)last;
+    magazine->count -= n;
+
+    pthread_mutex_lock(&pool->lock);
+    pool_put_chain(pool, first, last);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  *(void **)ptr = magazine->head;
+  magazine->head = ptr;
+  magazine->count++;
+}
+
+/* pool_thread_teardown */
+// gives the slots in an exiting thread's magazines back to their pools
+static void pool_thread_teardown() {
+  pthread_mutex_lock(&pools_lock);
+  for (size_t i = 0; i < POOL_MAGAZINE_SLOTS; i++) {
+    pool_magazine_t *magazine = &pool_magazines[i];
+    if (magazine->count > 0 && pool_is_live(magazine)) {
+      void *last = magazine->head;
+      while (*(void **)last) {
+        last = *(void **)last;
+      }
+      pthread_mutex_lock(&magazine->pool->lock);
+      pool_put_chain(magazine->pool, magazine->head, last);
+      pthread_mutex_unlock(&magazine->pool->lock);
     }
+    magazine->pool = NULL;
+    magazine->head = NULL;
+    magazine->count = 0;
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+/* tiny_pool_destroy */
+// frees the pool's chunks. slots still in other threads' magazines are
+// dropped with them, those magazines are reset the next time they're seen
+void tiny_pool_destroy(tiny_pool_t *pool) {
+  if (pool == NULL) {
+    return;
   }
 
-  // coalesce with previous block-
-  if (block->prev && block->prev->is_free) {
-    printf("DEBUG - we coalesce with previous block\n");
-    block->size += sizeof(memory_block_t) + block->prev->size;
-    block->prev->next = block->next;
-    if (block->next) {
-      block->next->prev = block->prev;
+  pthread_mutex_lock(&pools_lock);
+  for (tiny_pool_t **link = &pools; *link; link = &(*link)->next) {
+    if (*link == pool) {
+      *link = pool->next;
+      break;
     }
   }
+  pthread_mutex_unlock(&pools_lock);
 
-  printf("DEBUG - we unlock mutex\n");
-  pthread_mutex_unlock(&malloc_mutex);
-  printf("DEBUG - we unlocked mutex and we exit tinyfree\n");
+  for (size_t i = 0; i < POOL_MAGAZINE_SLOTS; i++) {
+    if (pool_magazines[i].pool == pool) {
+      pool_magazines[i].pool = NULL;
+      pool_magazines[i].head = NULL;
+      pool_magazines[i].count = 0;
+    }
+  }
+
+  while (pool->chunks) {
+    region_chunk_t *next = pool->chunks->next;
+    tinyfree(pool->chunks);
+    pool->chunks = next;
+  }
+  pthread_mutex_destroy(&pool->lock);
+  tinyfree(pool);
 }
@@ -2,16 +2,232 @@
 #define TINYMALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Function prototypes
 void *tinymalloc(size_t size);
 void tinyfree(void *ptr);
+void *tinyrealloc(void *ptr, size_t size);
+void *tinycalloc(size_t nmemb, size_t size);
+
+// frees ptr, which was allocated by tinymalloc, tinycalloc or tinyrealloc
+// with this size. small objects skip their header lookup. use tinyfree for
+// memory from the aligned allocation functions
+void tinyfree_sized(void *ptr, size_t size);
+
+// allocate n objects of size bytes into out, returning how many were
+// allocated, and free n pointers, taking each arena lock at most once per
+// call rather than once per object
+size_t tinymalloc_batch(size_t size, size_t n, void **out);
+void tinyfree_batch(void **ptrs, size_t n);
+
+// aligned allocation. alignment must be a power of two, and for
+// tiny_posix_memalign a multiple of sizeof(void *) too. alignments up to a
+// cache line are served from size classes whose slots are aligned already
+void *tiny_aligned_alloc(size_t alignment, size_t size);
+int tiny_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+// regions: bump allocation with everything freed at once. tiny_arena_reset
+// frees all of a region's objects in O(1) and keeps its memory for reuse,
+// tiny_arena_destroy gives the memory back. a region isn't thread-safe.
+// chunk_size 0 picks the default chunk size
+typedef struct tiny_arena tiny_arena_t;
+
+tiny_arena_t *tiny_arena_create(size_t chunk_size);
+void *tiny_arena_alloc(tiny_arena_t *arena, size_t size);
+void tiny_arena_reset(tiny_arena_t *arena);
+void tiny_arena_destroy(tiny_arena_t *arena);
+
+// pools of fixed-size objects of obj_size bytes aligned to align, a power
+// of two. tiny_pool_alloc and tiny_pool_free pop and push an intrusive free
+// list under the pool's lock, or with a magazine depth set, use a per-thread
+// magazine of up to depth free objects first. a pool must not be in use
+// anymore when it's destroyed, which frees all of its objects
+typedef struct tiny_pool tiny_pool_t;
+
+tiny_pool_t *tiny_pool_create(size_t obj_size, size_t align);
+int tiny_pool_set_magazine(tiny_pool_t *pool, unsigned int depth);
+void *tiny_pool_alloc(tiny_pool_t *pool);
+void tiny_pool_free(tiny_pool_t *pool, void *ptr);
+void tiny_pool_destroy(tiny_pool_t *pool);
+
+// returns how many bytes may be used at ptr, at least the size it was
+// allocated with. 0 for NULL and for memory tinymalloc doesn't own
+size_t tinymalloc_usable_size(void *ptr);
+
+// tells whether ptr points into memory tinymalloc manages: a slab, a heap
+// segment or a large mapping, not whether it's still allocated. tinyfree
+// and tinyfree_sized ignore pointers it rejects, tinyrealloc fails on them
+// with EINVAL and debug builds abort
+int tinymalloc_owns(const void *ptr);
+
+// sets how many free objects of the size class serving size each thread
+// may cache. 0 disables the cache for that class
+int tinymalloc_set_tcache_depth(size_t size, unsigned int depth);
+
+// requests of at least bytes (TINYMALLOC_LARGE_THRESHOLD by default) get a
+// mapping of their own, unmapped when freed. bytes must exceed the largest
+// slab size class (1024)
+int tinymalloc_set_large_threshold(size_t bytes);
+
+// free runs of the heap left untouched for about ms milliseconds
+// (TINYMALLOC_DECAY_MS by default) have their pages given back to the OS
+// lazily, as the heap keeps being used. tinymalloc_trim gives back all the
+// free memory it can right away and returns how many bytes it released
+void tinymalloc_set_decay(unsigned int ms);
+size_t tinymalloc_trim(void);
+
+// deferred coalescing, off with 0 (TINYMALLOC_DEFERRED_COALESCING by
+// default). freed heap blocks under 64 KiB are kept unmerged on quick
+// lists for reuse by requests of about their size, and each arena merges
+// them all at once after deferring blocks of them, when a request misses
+// and on trim
+void tinymalloc_set_deferred_coalescing(unsigned int blocks);
+
+// huge page backed heap segments, off by default. segments mapped from
+// then on are aligned to 2 MiB and get transparent huge pages, or explicit
+// ones (MAP_HUGETLB) with TINYMALLOC_HUGE_HUGETLB, falling back to
+// transparent ones and those to small pages where they can't be had
+enum tinymalloc_huge_pages {
+  TINYMALLOC_HUGE_NONE,
+  TINYMALLOC_HUGE_THP,
+  TINYMALLOC_HUGE_HUGETLB,
+};
+
+int tinymalloc_set_huge_pages(int mode);
 
-void *initialize_heap();
-struct block_header *find_free_block(size_t size);
-struct block_header *extend_heap(size_t size);
-struct block_header *split_block(struct block_header *block, size_t size);
-void remove_from_free_list(struct block_header *block);
-void coalesce(struct block_header *block);
+// applies a configuration in the format of the TINYMALLOC_CONF environment
+// variable, comma-separated key:value pairs such as "arenas:8,decay_ms:0":
+// segment_initial, segment_max, large_threshold, arenas, tcache_depth,
+// decay_ms, deferred_coalescing, huge_pages (off, thp or hugetlb) and
+// sample_interval. sizes may end in k, m or g. arenas and the segment sizes
+// only take effect before the first allocation. TINYMALLOC_CONF is read at
+// that allocation and comes on top. returns 0, or -1 with errno set to
+// EINVAL if a pair is bad or EBUSY if it came too late, the other pairs
+// being applied anyway
+int tinymalloc_set_conf(const char *conf);
+
+// usage of a NUMA node. nodes are numbered as by the kernel, below
+// tinymalloc_numa_nodes(). without NUMA, all arenas are on node 0
+typedef struct tinymalloc_node_stats {
+  size_t arenas;        // arenas bound to the node
+  size_t segment_bytes; // heap segments mapped by them
+  size_t slab_bytes;    // slabs carved by them
+  size_t remote_frees;  // objects freed to them by other arenas' threads
+} tinymalloc_node_stats_t;
+
+unsigned int tinymalloc_numa_nodes(void);
+int tinymalloc_node_stats(unsigned int node, tinymalloc_node_stats_t *stats);
+
+// allocator statistics. counters are kept per thread without any lock,
+// so a snapshot taken while other threads allocate is only approximately
+// consistent. bytes are counted as the allocator hands them out: slab
+// slots, blocks with their header and large mappings with theirs
+#define TINYMALLOC_STATS_CLASSES 22 // 20 slab classes, the heap, large
+
+typedef struct tinymalloc_class_stats {
+  size_t size; // object size of a slab class, 0 for the heap and large
+  uint64_t allocs;
+  uint64_t frees;
+} tinymalloc_class_stats_t;
+
+typedef struct tinymalloc_stats {
+  size_t mapped;     // heap segments, slabs and large mappings
+  size_t allocated;  // handed out and not freed
+  size_t free;       // free heap blocks and empty slabs
+  size_t fragmented; // neither: free slab slots, thread caches, headers
+  uint64_t mmap_calls;
+  uint64_t munmap_calls;
+  uint64_t lock_contention; // lock acquisitions that had to wait
+  uint64_t tcache_hits;     // small allocations served by a thread cache
+  uint64_t tcache_misses;   // thread cache refills
+  tinymalloc_class_stats_t classes[TINYMALLOC_STATS_CLASSES];
+} tinymalloc_stats_t;
+
+void tinymalloc_stats(tinymalloc_stats_t *stats);
+
+// mallctl-style access by name to the statistics ("stats.mapped",
+// "stats.class.3.allocs", ...) and to the tunables ("opt.decay_ms",
+// "opt.deferred_coalescing", "opt.large_threshold", "opt.huge_pages",
+// "opt.sample_interval"). the value is copied to oldp if it's set, *oldlenp
+// having to be its size, and replaced by newp if that's set. returns 0,
+// ENOENT for unknown names, EINVAL for bad sizes or values and EPERM for
+// writes to statistics
+int tinymalloc_ctl(const char *name, void *oldp, size_t *oldlenp,
+                   const void *newp, size_t newlen);
+
+// sampling heap profiler, off until an interval is set. about one
+// allocation per interval bytes is recorded with its backtrace; 0 turns it
+// off again. tinymalloc_profile_dump writes the live samples and the sites
+// of all samples taken to fd as a pprof legacy heap profile ("heap_v2"),
+// followed by /proc/self/maps. it returns 0, or -1 if a write failed
+void tinymalloc_set_sample_interval(size_t bytes);
+int tinymalloc_profile_dump(int fd);
+
+// trace events, recorded when built with TINYMALLOC_TRACE. the comments
+// say what ptr, size and aux of a record hold
+enum tinymalloc_trace_event {
+  TINYMALLOC_TRACE_MALLOC = 1,    // pointer returned, size, alignment or 0
+  TINYMALLOC_TRACE_FREE,          // pointer freed, size if known
+  TINYMALLOC_TRACE_REMOTE_FREE,   // first object queued, count, owner arena
+  TINYMALLOC_TRACE_REMOTE_DRAIN,  // first object drained, count, arena
+  TINYMALLOC_TRACE_TCACHE_REFILL, // first object, count, size class
+  TINYMALLOC_TRACE_TCACHE_FLUSH,  // first object, count, current arena
+  TINYMALLOC_TRACE_HEAP_INIT,     // region, size, arena
+  TINYMALLOC_TRACE_MAP,           // mapping, size, arena
+  TINYMALLOC_TRACE_SPLIT,         // block, size kept, size of the tail
+  TINYMALLOC_TRACE_COALESCE,      // block kept, size absorbed, block absorbed
+  TINYMALLOC_TRACE_UNMAP,         // mapping, size, arena
+  TINYMALLOC_TRACE_REALLOC,       // pointer returned, size, old pointer
+  TINYMALLOC_TRACE_CALLOC,        // pointer returned, total size
+  TINYMALLOC_TRACE_PURGE,         // block, bytes given back, 1 if lazy
+  TINYMALLOC_TRACE_REALLOC_START, // old pointer, size asked for
+};
+
+// one fixed-size binary trace record, as written by tinymalloc_trace_dump
+// and by the shim when TINYMALLOC_CAPTURE is set. the shim writes a
+// REALLOC_START before each realloc, so that the old pointer is released
+// in the trace before another thread can be handed its address, and the
+// REALLOC of the same thread that follows it ends it
+typedef struct tinymalloc_trace_record {
+  uint64_t timestamp; // CLOCK_MONOTONIC, in nanoseconds
+  uint64_t ptr;
+  uint64_t size;
+  uint64_t aux;
+  uint32_t thread; // small per-thread id, in order of first trace
+  uint16_t event;  // enum tinymalloc_trace_event
+  uint16_t reserved;
+} tinymalloc_trace_record_t;
+
+// writes every thread's trace ring to fd and returns the number of records
+// written. always 0 unless built with TINYMALLOC_TRACE
+size_t tinymalloc_trace_dump(int fd);
+
+// debug builds, compiled with TINYMALLOC_DEBUG, check every free for
+// double and invalid frees, overflows past the end and writes to freed
+// memory, and abort on any. tinymalloc_leak_dump then writes what's still
+// allocated to fd and returns how many allocations that is, which also
+// happens at exit. always 0 in normal builds
+size_t tinymalloc_leak_dump(int fd);
+
+// heap internals. each works on one arena and expects its lock to be held
+struct arena;
+
+void *initialize_heap(struct arena *arena);
+struct block_header *find_free_block(struct arena *arena, size_t size);
+struct block_header *extend_heap(struct arena *arena, size_t size);
+struct block_header *split_block(struct arena *arena,
+                                 struct block_header *block, size_t size);
+void remove_from_free_list(struct arena *arena, struct block_header *block);
+// merges every block the arena deferred coalescing of
+void coalesce(struct arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,58 @@
+#ifndef TINYMALLOC_HPP
+#define TINYMALLOC_HPP
+
+#include "tinymalloc.h"
+#include <cstddef>
+#include <limits>
+#include <new>
+
+// a namespace can't share its name with the tinymalloc function, but a
+// struct can: that's what makes tinymalloc::allocator<T> spellable
+struct tinymalloc {
+  // STL allocator drawing from tinymalloc. containers know the size of
+  // what they give back, so deallocation goes through tinyfree_sized
+  template <class T> struct allocator {
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <class U> allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+      if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+        throw std::bad_array_new_length();
+      }
+      std::size_t size = n ? n * sizeof(T) : 1;
+      void *ptr = overaligned ? ::tiny_aligned_alloc(alignof(T), size)
+                              : ::tinymalloc(size);
+      if (ptr == nullptr) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T *>(ptr);
+    }
+
+    // over-aligned objects may sit in a larger size class than their size
+    void deallocate(T *ptr, std::size_t n) noexcept {
+      if (overaligned) {
+        ::tinyfree(ptr);
+      } else {
+        ::tinyfree_sized(ptr, n ? n * sizeof(T) : 1);
+      }
+    }
+
+    template <class U>
+    friend bool operator==(const allocator &, const allocator<U> &) noexcept {
+      return true;
+    }
+
+    template <class U>
+    friend bool operator!=(const allocator &, const allocator<U> &) noexcept {
+      return false;
+    }
+
+  private:
+    static constexpr bool overaligned =
+        alignof(T) > alignof(std::max_align_t);
+  };
+};
+
+#endif
@@ -0,0 +1,124 @@
+// replaces the global operator new and delete with tinymalloc. link it
+// into a C++ program along with tinymalloc.c. sized deletes go through
+// tinyfree_sized, which skips the header lookup of small objects
+#include "tinymalloc.h"
+#include <cstddef>
+#include <new>
+
+namespace {
+
+/* allocate */
+// operator new semantics: retry through the new handler until it gives
+// up, then throw if the caller can take it
+void *allocate(std::size_t size, std::size_t alignment, bool nothrow) {
+  if (size == 0) {
+    size = 1;
+  }
+
+  for (;;) {
+    void *ptr = alignment ? tiny_aligned_alloc(alignment, size)
+                          : tinymalloc(size);
+    if (ptr) {
+      return ptr;
+    }
+
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      if (nothrow) {
+        return nullptr;
+      }
+      throw std::bad_alloc();
+    }
+    try {
+      handler();
+    } catch (...) {
+      if (nothrow) {
+        return nullptr;
+      }
+      throw;
+    }
+  }
+}
+
+} // namespace
+
+void *operator new(std::size_t size) { return allocate(size, 0, false); }
+
+void *operator new[](std::size_t size) { return allocate(size, 0, false); }
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, 0, true);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, 0, true);
+}
+
+void operator delete(void *ptr) noexcept { tinyfree(ptr); }
+
+void operator delete[](void *ptr) noexcept { tinyfree(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  tinyfree(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  tinyfree(ptr);
+}
+
+#if __cpp_sized_deallocation >= 201309L
+// new(0) allocated one byte, so that's the size to free
+void operator delete(void *ptr, std::size_t size) noexcept {
+  tinyfree_sized(ptr, size ? size : 1);
+}
+
+void operator delete[](void *ptr, std::size_t size) noexcept {
+  tinyfree_sized(ptr, size ? size : 1);
+}
+#endif
+
+#if __cpp_aligned_new >= 201606L
+// over-aligned objects may sit in a larger size class than their size, so
+// even their sized deletes go through tinyfree
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment), false);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment), false);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<std::size_t>(alignment), true);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<std::size_t>(alignment), true);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept { tinyfree(ptr); }
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  tinyfree(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  tinyfree(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  tinyfree(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  tinyfree(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  tinyfree(ptr);
+}
+#endif
@@ -0,0 +1,336 @@
+// drop-in replacement of the libc allocation functions on top of
+// tinymalloc. built together with tinymalloc.c as a shared library, see the
+// README, and preloaded it makes tinymalloc the allocator of any program
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tinymalloc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+// initial-exec, as in tinymalloc.c, so thread-locals never allocate
+#define SHIM_TLS _Thread_local __attribute__((tls_model("initial-exec")))
+
+/* Capture */
+// with TINYMALLOC_CAPTURE set to a path, every allocation call is appended
+// to that file as a tinymalloc_trace_record_t, to be replayed offline by
+// replay_tinymalloc. each thread fills a buffer of its own, written out
+// when it's full and when the thread exits, or the main thread at exit.
+// the buffers of threads still running at exit are lost, and forked
+// children aren't captured
+#define CAPTURE_RECORDS 512
+
+typedef struct capture_buffer {
+  struct capture_buffer *next; // free list of exited threads' buffers
+  uint32_t thread;
+  uint32_t count;
+  tinymalloc_trace_record_t records[CAPTURE_RECORDS];
+} capture_buffer_t;
+
+enum { CAPTURE_UNKNOWN, CAPTURE_ON, CAPTURE_OFF };
+
+static _Atomic int capture_state = CAPTURE_UNKNOWN;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t capture_key;
+static int capture_fd = -1;
+static uint32_t capture_threads = 0;       // under capture_lock
+static capture_buffer_t *capture_free = NULL; // under capture_lock
+static SHIM_TLS capture_buffer_t *capture_buffer = NULL;
+// set once the thread's buffer is given back, by the key destructor, with
+// the id it had: glibc still frees after that, see capture
+static SHIM_TLS bool capture_exited = false;
+static SHIM_TLS uint32_t capture_exited_thread;
+
+/* capture_write */
+static void capture_write(const tinymalloc_trace_record_t *records,
+                          size_t count) {
+  pthread_mutex_lock(&capture_lock);
+  const char *buf = (const char *)records;
+  size_t len = count * sizeof(tinymalloc_trace_record_t);
+  while (len > 0) {
+    ssize_t n = write(capture_fd, buf, len);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    if (n > 0) {
+      buf += n;
+      len -= (size_t)n;
+    }
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+/* capture_flush */
+static void capture_flush(capture_buffer_t *buffer) {
+  capture_write(buffer->records, buffer->count);
+  buffer->count = 0;
+}
+
+/* capture_thread_exit */
+// a forked child's thread may still have the parent's buffer as its key
+static void capture_thread_exit(void *arg) {
+  capture_buffer_t *buffer = arg;
+  if (atomic_load(&capture_state) == CAPTURE_ON) {
+    capture_flush(buffer);
+  }
+  capture_buffer = NULL;
+  capture_exited = true;
+  capture_exited_thread = buffer->thread;
+  pthread_mutex_lock(&capture_lock);
+  buffer->next = capture_free;
+  capture_free = buffer;
+  pthread_mutex_unlock(&capture_lock);
+}
+
+/* capture_exit */
+__attribute__((destructor)) static void capture_exit() {
+  if (capture_buffer) {
+    capture_flush(capture_buffer);
+  }
+}
+
+/* capture_prefork */
+// capture_lock is held while a buffer is written out, so a fork waits for
+// the flush rather than leaving the child a lock nobody releases
+static void capture_prefork() { pthread_mutex_lock(&capture_lock); }
+
+/* capture_postfork_parent */
+static void capture_postfork_parent() { pthread_mutex_unlock(&capture_lock); }
+
+/* capture_postfork_child */
+// forked children aren't captured. the buffer of the thread that forked
+// holds the parent's records, it's dropped unwritten
+static void capture_postfork_child() {
+  pthread_mutex_init(&capture_lock, NULL);
+  atomic_store(&capture_state, CAPTURE_OFF);
+  capture_buffer = NULL;
+}
+
+/* capture_register_fork_handlers */
+// as in tinymalloc.c, at load rather than by the first allocation call,
+// since pthread_atfork may allocate
+__attribute__((constructor)) static void capture_register_fork_handlers() {
+  pthread_atfork(capture_prefork, capture_postfork_parent,
+                 capture_postfork_child);
+}
+
+/* capture_start */
+// run by the first allocation call or when the library is loaded, nothing
+// here may allocate
+static bool capture_start() {
+  pthread_mutex_lock(&capture_lock);
+  if (atomic_load(&capture_state) == CAPTURE_UNKNOWN) {
+    int state = CAPTURE_OFF;
+    const char *path = getenv("TINYMALLOC_CAPTURE");
+    if (path && *path) {
+      capture_fd =
+          open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+      if (capture_fd >= 0 &&
+          pthread_key_create(&capture_key, capture_thread_exit) == 0) {
+        state = CAPTURE_ON;
+      }
+    }
+    atomic_store(&capture_state, state);
+  }
+  pthread_mutex_unlock(&capture_lock);
+  return atomic_load(&capture_state) == CAPTURE_ON;
+}
+
+/* capture_load */
+// starts capturing at load time unless an allocation did already, so that
+// capture_key is made among the first keys. the values of keys past the
+// first 32 live in arrays pthread_setspecific allocates, and an allocation
+// inside it is captured: if it's a thread's first, the capture's own
+// pthread_setspecific would run nested, and glibc loses one of the arrays
+__attribute__((constructor)) static void capture_load() { capture_start(); }
+
+/* capture_thread_setup */
+static capture_buffer_t *capture_thread_setup() {
+  pthread_mutex_lock(&capture_lock);
+  capture_buffer_t *buffer = capture_free;
+  if (buffer) {
+    capture_free = buffer->next;
+  } else {
+    buffer = mmap(NULL, sizeof(capture_buffer_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffer = buffer == MAP_FAILED ? NULL : buffer;
+  }
+  if (buffer) {
+    buffer->thread = capture_threads++;
+    buffer->count = 0;
+  }
+  pthread_mutex_unlock(&capture_lock);
+
+  // pthread_setspecific may allocate, and that allocation is captured. the
+  // buffer is set first so it's captured there, not by a new setup
+  if (buffer) {
+    capture_buffer = buffer;
+    pthread_setspecific(capture_key, buffer);
+  }
+  return buffer;
+}
+
+/* capture */
+// one atomic load when capturing is off. calls made after the thread's
+// key destructor ran, such as glibc freeing its key arrays, are written
+// out one by one rather than setting up a buffer nothing would flush
+static void capture(uint16_t event, const void *ptr, size_t size,
+                    uint64_t aux) {
+  int state = atomic_load_explicit(&capture_state, memory_order_acquire);
+  if (state == CAPTURE_OFF || (state == CAPTURE_UNKNOWN && !capture_start())) {
+    return;
+  }
+  capture_buffer_t *buffer = capture_buffer;
+  tinymalloc_trace_record_t late;
+  if (buffer == NULL && !capture_exited &&
+      (buffer = capture_thread_setup()) == NULL) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  tinymalloc_trace_record_t *record =
+      buffer ? &buffer->records[buffer->count] : &late;
+  record->timestamp = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+  record->ptr = (uint64_t)(uintptr_t)ptr;
+  record->size = size;
+  record->aux = aux;
+  record->thread = buffer ? buffer->thread : capture_exited_thread;
+  record->event = event;
+  record->reserved = 0;
+  if (buffer == NULL) {
+    capture_write(&late, 1);
+  } else if (++buffer->count == CAPTURE_RECORDS) {
+    capture_flush(buffer);
+  }
+}
+
+/* malloc */
+// malloc(0) must return a unique pointer, tinymalloc(0) returns NULL
+SHIM_EXPORT void *malloc(size_t size) {
+  void *ptr = tinymalloc(size ? size : 1);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  } else {
+    capture(TINYMALLOC_TRACE_MALLOC, ptr, size, 0);
+  }
+  return ptr;
+}
+
+/* free */
+// captured before the memory can be reused, so an allocation of the same
+// address by another thread comes later in the trace
+SHIM_EXPORT void free(void *ptr) {
+  if (ptr) {
+    capture(TINYMALLOC_TRACE_FREE, ptr, 0, 0);
+  }
+  tinyfree(ptr);
+}
+
+/* calloc */
+SHIM_EXPORT void *calloc(size_t nmemb, size_t size) {
+  if (nmemb == 0 || size == 0) {
+    nmemb = 1;
+    size = 1;
+  }
+
+  void *ptr = tinycalloc(nmemb, size);
+  if (ptr == NULL) {
+    errno = ENOMEM;
+  } else {
+    capture(TINYMALLOC_TRACE_CALLOC, ptr, nmemb * size, 0);
+  }
+  return ptr;
+}
+
+/* realloc */
+// like glibc, realloc(ptr, 0) frees ptr and returns NULL. a moving realloc
+// frees ptr before it returns, so as for free its start is captured first.
+// when it fails, it ends on ptr, which is still live. pointers tinymalloc
+// doesn't own are rejected with EINVAL and never captured
+SHIM_EXPORT void *realloc(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  bool owned = tinymalloc_owns(ptr);
+  if (owned) {
+    capture(size ? TINYMALLOC_TRACE_REALLOC_START : TINYMALLOC_TRACE_FREE, ptr,
+            size, 0);
+  }
+
+  void *moved = tinyrealloc(ptr, size);
+  if (moved == NULL && size != 0) {
+    errno = owned ? ENOMEM : EINVAL;
+    if (owned) {
+      capture(TINYMALLOC_TRACE_REALLOC, ptr, tinymalloc_usable_size(ptr),
+              (uintptr_t)ptr);
+    }
+  } else if (moved) {
+    capture(TINYMALLOC_TRACE_REALLOC, moved, size, (uintptr_t)ptr);
+  }
+  return moved;
+}
+
+/* posix_memalign */
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  int result = tiny_posix_memalign(memptr, alignment, size ? size : 1);
+  if (result == 0) {
+    capture(TINYMALLOC_TRACE_MALLOC, *memptr, size, alignment);
+  }
+  return result;
+}
+
+/* aligned_alloc */
+SHIM_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr = tiny_aligned_alloc(alignment, size ? size : 1);
+  if (ptr == NULL && errno != EINVAL) {
+    errno = ENOMEM;
+  } else if (ptr) {
+    capture(TINYMALLOC_TRACE_MALLOC, ptr, size, alignment);
+  }
+  return ptr;
+}
+
+/* memalign */
+SHIM_EXPORT void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+/* valloc */
+SHIM_EXPORT void *valloc(size_t size) {
+  return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+/* pvalloc */
+// like valloc, with the size rounded up to whole pages
+SHIM_EXPORT void *pvalloc(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+/* malloc_usable_size */
+SHIM_EXPORT size_t malloc_usable_size(void *ptr) {
+  return tinymalloc_usable_size(ptr);
+}
+
+/* malloc_trim */
+// glibc's pad is the free memory to keep at the top of its heap, which
+// tinymalloc doesn't have. returns 1 if any memory was given back
+SHIM_EXPORT int malloc_trim(size_t pad) {
+  (void)pad;
+  return tinymalloc_trim() > 0;
+}